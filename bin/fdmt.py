@@ -15,13 +15,103 @@ by Bruce Wu with modifications by Ian Brown. See also the fdmt.m codes under
 https://webhome.weizmann.ac.il/home/eofek/matlab/FunList.html
 Reference: Zackay & Ofek (2014/2017), "An accurate and efficient algorithm for
 detection of radio bursts with an unknown dispersion measure".
+
+FDMT() runs the compiled engine in ../fdmt (libfdmt.so, loaded with ctypes) when
+it is available, and falls back to the numpy kernel below (FDMT_reference)
+otherwise. Its shift tables live in an FDMTPlan, built once per
+(N_f, f_min, f_max, maxDT) and reused for every chunk; an FDMTStream runs
+one over a continuous series block by block without overlap. The engine reproduces this kernel's index arithmetic exactly, so both
+give bit-for-bit identical output; fdmt_validate.py checks that. Build it with
+`make -C fdmt` and deploy libfdmt.so next to this file (or point FDMT_LIB at it).
+Worker threads default to all cores; set FDMT_NUM_THREADS (or call
+set_num_threads) when several searches share a node.
 """
+import ctypes
+import functools
 import logging
+import os
 
 import numpy as np
 
 logger = logging.getLogger('FDMT')
 
+# Element types understood by libfdmt.so; must match the FDMT_* codes in fdmt.h.
+_NATIVE_DTYPES = {
+  np.dtype('float32'): 0,
+  np.dtype('float64'): 1,
+  np.dtype('int32'): 2,
+  np.dtype('int64'): 3,
+  np.dtype('int16'): 4,
+  np.dtype('float16'): 5,
+}
+
+
+def _load_native():
+  """Load libfdmt.so from $FDMT_LIB, next to this file, or ../fdmt; None if absent."""
+  here = os.path.dirname(os.path.abspath(__file__))
+  for path in (os.environ.get('FDMT_LIB'),
+               os.path.join(here, 'libfdmt.so'),
+               os.path.join(here, '..', 'fdmt', 'libfdmt.so')):
+    if not path or not os.path.exists(path):
+      continue
+    lib = ctypes.CDLL(path)
+    c_int, c_double, c_void_p = ctypes.c_int, ctypes.c_double, ctypes.c_void_p
+    lib.fdmt_strerror.restype = ctypes.c_char_p
+    lib.fdmt_strerror.argtypes = [c_int]
+    lib.fdmt_set_num_threads.argtypes = [c_int]
+    lib.fdmt_simd.restype = ctypes.c_char_p
+    lib.fdmt_simd.argtypes = []
+    lib.fdmt_plan_create.argtypes = [c_int, c_double, c_double, c_int, ctypes.POINTER(c_void_p)]
+    lib.fdmt_plan_destroy.argtypes = [c_void_p]
+    lib.fdmt_plan_destroy.restype = None
+    lib.fdmt_plan_params.argtypes = [c_void_p, ctypes.POINTER(c_int), ctypes.POINTER(c_double),
+                                     ctypes.POINTER(c_double), ctypes.POINTER(c_int)]
+    lib.fdmt_plan_params.restype = None
+    lib.fdmt_plan_output_rows.argtypes = [c_void_p]
+    lib.fdmt_plan_create_range.argtypes = [c_int, c_double, c_double, c_int, c_int,
+                                           ctypes.POINTER(c_void_p)]
+    lib.fdmt_plan_min_dt.argtypes = [c_void_p]
+    lib.fdmt_plan_max_terms.argtypes = [c_void_p]
+    lib.fdmt_plan_max_terms.restype = ctypes.c_longlong
+    lib.fdmt_plan_save.argtypes = [c_void_p, ctypes.c_char_p]
+    lib.fdmt_plan_load.argtypes = [ctypes.c_char_p, ctypes.POINTER(c_void_p)]
+    lib.fdmt_plan_execute.argtypes = [c_void_p, c_void_p, c_int, c_int, c_void_p]
+    lib.fdmt_plan_execute_batch.argtypes = [c_void_p, c_void_p, c_int, c_int, c_int, c_void_p]
+    lib.fdmt_plan_release.argtypes = [c_void_p]
+    lib.fdmt_plan_release.restype = None
+    lib.fdmt_stream_create.argtypes = [c_void_p, c_int, c_int, ctypes.POINTER(c_void_p)]
+    lib.fdmt_stream_destroy.argtypes = [c_void_p]
+    lib.fdmt_stream_destroy.restype = None
+    lib.fdmt_stream_push.argtypes = [c_void_p, c_void_p, c_int, c_void_p]
+    lib.fdmt_stream_position.argtypes = [c_void_p]
+    lib.fdmt_stream_position.restype = ctypes.c_longlong
+    lib.fdmt_stream_reset.argtypes = [c_void_p]
+    lib.fdmt_stream_reset.restype = None
+    logger.debug(f'using native FDMT from {path}')
+    return lib
+  logger.info('libfdmt.so not found, using the numpy FDMT kernel')
+  return None
+
+
+_native = _load_native()
+
+
+def set_num_threads(n):
+  """Number of threads for the native engine (0 restores the default)."""
+  if _native is not None:
+    _native.fdmt_set_num_threads(int(n))
+
+
+def simd():
+  """Instruction set of the native inner loops ('avx512', 'avx2', 'sse4.2',
+  'scalar'; override with FDMT_SIMD), or None without libfdmt.so."""
+  return _native.fdmt_simd().decode() if _native is not None else None
+
+
+def _check(status):
+  if status != 0:
+    raise RuntimeError(f'libfdmt: {_native.fdmt_strerror(status).decode()}')
+
 
 def FDMT_initialization(Image, f_min, f_max, maxDT, dtype):
    """
@@ -129,6 +219,368 @@ def FDMT_iteration(Input, maxDT, F, f_min, f_max, iteration_num, dtype):
 def FDMT(Image, f_min, f_max, maxDT, dtype):
     """
     The Fast discrete Dispersion Measure Transform (FDMT) algorithm.
+
+    Same arguments and result as FDMT_reference; runs in the native engine, with
+    a cached FDMTPlan per parameter set, when libfdmt.so is loaded and dtype is
+    float32/float64/int16/int32/int64/float16. Image is cast
+    to dtype first, which matches the reference exactly whenever Image already
+    has that dtype (the production case: float32 in, float32 out).
+    """
+    dtype = np.dtype(dtype)
+    if _native is None or dtype not in _NATIVE_DTYPES:
+      return FDMT_reference(Image, f_min, f_max, maxDT, dtype)
+    return FDMT_native(Image, f_min, f_max, maxDT, dtype)
+
+
+def FDMT_native(Image, f_min, f_max, maxDT, dtype):
+    """FDMT in libfdmt.so. Raises RuntimeError if the library is not loaded."""
+    if _native is None:
+      raise RuntimeError('libfdmt.so not loaded')
+    return _cached_plan(Image.shape[0], f_min, f_max, maxDT)(Image, dtype)
+
+
+class FDMTPlan:
+  """Precomputed shift/row tables of the FDMT for one (N_f, f_min, f_max, maxDT).
+
+  Build it once per observation -- or load() one another worker saved -- and call
+  it on every chunk: plan(Image, dtype) gives the same result as
+  FDMT(Image, f_min, f_max, maxDT, dtype) without recomputing any of deltaT,
+  deltaTLocal, dT_middle, dT_middle_larger or dT_rest. Without libfdmt.so a plan
+  only remembers its parameters and runs FDMT_reference (and cannot be saved).
+
+  minDT > 0 keeps only the output rows minDT.. (i.e. FDMT(...)[minDT:]), and the
+  native engine skips every partial sum that could only have reached the dropped
+  rows. for_dm_range() picks minDT and maxDT from a DM range.
+  """
+
+  def __init__(self, N_f, f_min, f_max, maxDT, minDT=0):
+    self.N_f, self.f_min, self.f_max, self.maxDT = int(N_f), float(f_min), float(f_max), int(maxDT)
+    self.minDT = int(minDT)
+    self._handle = None
+    if N_f & (N_f - 1):
+      raise NotImplementedError(f'Input frequency channel dimension ({N_f}) must be a power of 2')
+    if _native is not None:
+      handle = ctypes.c_void_p()
+      _check(_native.fdmt_plan_create_range(self.N_f, self.f_min, self.f_max, self.minDT,
+                                            self.maxDT, ctypes.byref(handle)))
+      self._handle = handle
+
+  @classmethod
+  def for_dm_range(cls, N_f, f_min, f_max, dt, dm_range):
+    """Plan covering dm_range = (DM_min, DM_max) in pc/cm^3 for sample time dt (s)
+    and f_min/f_max in MHz: rows int(DM * 4148.808 * (f_min**-2 - f_max**-2) / dt),
+    the same delays fdmt_search.py uses."""
+    delay = lambda DM: int(DM * 4148.808 * (f_min**-2 - f_max**-2) / dt)
+    return cls(N_f, f_min, f_max, delay(dm_range[1]), delay(dm_range[0]))
+
+  def __del__(self):
+    if self._handle is not None and _native is not None:
+      _native.fdmt_plan_destroy(self._handle)
+      self._handle = None
+
+  def __repr__(self):
+    return (f'FDMTPlan(N_f={self.N_f}, f_min={self.f_min}, f_max={self.f_max}, maxDT={self.maxDT}'
+            f'{f", minDT={self.minDT}" if self.minDT else ""})')
+
+  @property
+  def output_rows(self):
+    if self._handle is None:
+      return None
+    return _native.fdmt_plan_output_rows(self._handle)
+
+  @property
+  def max_terms(self):
+    """Most input samples summed into any cell of the transform (any level).
+    Without libfdmt.so, the bound N_f * (initialization rows) instead."""
+    if self._handle is not None:
+      return _native.fdmt_plan_max_terms(self._handle)
+    deltaF = (self.f_max - self.f_min) / float(self.N_f)
+    deltaT = int(np.ceil((self.maxDT - 1) * (self.f_min**-2 - (self.f_min + deltaF)**-2) /
+                         (self.f_min**-2 - self.f_max**-2)))
+    return self.N_f * (deltaT + 1)
+
+  def accumulator_dtype(self, input_bits=8, signed=False):
+    """Narrowest of int16/int32/int64 that cannot overflow on input_bits-bit
+    samples (psrfits2fil writes unsigned 8-bit). int16 keeps the state cube at half
+    the size of float32, so more workers fit per node and more of it stays in
+    cache; it only fits small N_f. float16 (float32 adds, binary16 storage) is the
+    lossy alternative for larger bands."""
+    largest = 2**(input_bits - 1) if signed else 2**input_bits - 1
+    for dtype in ('int16', 'int32', 'int64'):
+      if self.max_terms * largest <= np.iinfo(dtype).max:
+        return np.dtype(dtype)
+    raise OverflowError(f'{self} cannot sum {input_bits}-bit input in int64')
+
+  def _reference(self, Image, dtype):
+    Output = FDMT_reference(Image, self.f_min, self.f_max, self.maxDT, dtype)
+    return Output[self.minDT:] if self.minDT else Output
+
+  def release(self):
+    """Free the working buffers until the next call."""
+    if self._handle is not None:
+      _native.fdmt_plan_release(self._handle)
+
+  def save(self, filename):
+    if self._handle is None:
+      raise RuntimeError('libfdmt.so not loaded: plans can only be saved from the native engine')
+    _check(_native.fdmt_plan_save(self._handle, os.fsencode(filename)))
+
+  @classmethod
+  def load(cls, filename):
+    if _native is None:
+      raise RuntimeError('libfdmt.so not loaded')
+    handle = ctypes.c_void_p()
+    _check(_native.fdmt_plan_load(os.fsencode(filename), ctypes.byref(handle)))
+    n_f, f_min, f_max, max_dt = ctypes.c_int(), ctypes.c_double(), ctypes.c_double(), ctypes.c_int()
+    _native.fdmt_plan_params(handle, ctypes.byref(n_f), ctypes.byref(f_min), ctypes.byref(f_max),
+                             ctypes.byref(max_dt))
+    plan = cls.__new__(cls)
+    plan.N_f, plan.f_min, plan.f_max, plan.maxDT = n_f.value, f_min.value, f_max.value, max_dt.value
+    plan.minDT = _native.fdmt_plan_min_dt(handle)
+    plan._handle = handle
+    return plan
+
+  @classmethod
+  def load_or_create(cls, filename, N_f, f_min, f_max, maxDT, minDT=0):
+    """Load the plan in `filename` if it was made for these parameters; otherwise
+    build it and save it there for the next worker. Safe to race: the file is
+    written under a temporary name and renamed into place."""
+    if _native is None:
+      return cls(N_f, f_min, f_max, maxDT, minDT)
+    try:
+      plan = cls.load(filename)
+      if ((plan.N_f, plan.f_min, plan.f_max, plan.maxDT, plan.minDT) ==
+          (int(N_f), float(f_min), float(f_max), int(maxDT), int(minDT))):
+        return plan
+      logger.info(f'{filename} is {plan}, rebuilding')
+    except (OSError, RuntimeError):
+      pass
+    plan = cls(N_f, f_min, f_max, maxDT, minDT)
+    tmp = f'{filename}.{os.getpid()}.tmp'
+    try:
+      plan.save(tmp)
+      os.replace(tmp, filename)
+    except (OSError, RuntimeError) as e:
+      logger.warning(f'could not save FDMT plan to {filename}: {e}')
+    return plan
+
+  def __call__(self, Image, dtype):
+    """Transform Image [N_f, N_s] (channel 0 == f_min); see FDMT()."""
+    dtype = np.dtype(dtype)
+    if self._handle is None or dtype not in _NATIVE_DTYPES:
+      return self._reference(Image, dtype)
+    Image = np.ascontiguousarray(Image, dtype)
+    N_f, N_s = Image.shape
+    if N_f != self.N_f:
+      raise ValueError(f'plan is for {self.N_f} channels, Image has {N_f}')
+    Output = np.empty((1, self.output_rows, N_s), dtype)
+    _check(_native.fdmt_plan_execute(self._handle, Image.ctypes.data, N_s,
+                                     _NATIVE_DTYPES[dtype], Output.ctypes.data))
+    return np.squeeze(Output)
+
+  def batch(self, Images, dtype, out=None):
+    """Transform Images [n_batch, N_f, N_s] (beams, polarization products or
+    chunks of one observation) in one pass; returns [n_batch, rows, N_s], written
+    into `out` when given (C-contiguous, that shape and dtype). Same result as
+    calling the plan on each image, with the thread scheduling shared."""
+    dtype = np.dtype(dtype)
+    n_batch, N_f, N_s = Images.shape
+    if N_f != self.N_f:
+      raise ValueError(f'plan is for {self.N_f} channels, Images have {N_f}')
+    if self._handle is None or dtype not in _NATIVE_DTYPES:
+      Output = np.stack([self._reference(Image, dtype).reshape(-1, N_s) for Image in Images])
+      if out is None:
+        return Output
+      out[...] = Output
+      return out
+    Images = np.ascontiguousarray(Images, dtype)
+    if out is None:
+      out = np.empty((n_batch, self.output_rows, N_s), dtype)
+    elif out.shape != (n_batch, self.output_rows, N_s) or out.dtype != dtype or not out.flags.c_contiguous:
+      raise ValueError(f'out must be a C-contiguous {dtype} array of shape {(n_batch, self.output_rows, N_s)}')
+    _check(_native.fdmt_plan_execute_batch(self._handle, Images.ctypes.data, n_batch, N_s,
+                                           _NATIVE_DTYPES[dtype], out.ctypes.data))
+    return out
+
+
+class FDMTStream:
+  """FDMT of one continuous series fed in consecutive blocks.
+
+  push(Block) takes the next Block [N_f, n] (n <= max_block) and returns the next
+  n columns of what the plan would give over the whole series so far, so the
+  caller never re-sends an overlap and never crops edge columns: concatenating
+  the pushes' outputs along time is bit-for-bit FDMT(series). The state carried
+  between pushes is the last ~maxDT samples of each level. Without libfdmt.so (or
+  for other dtypes) the same contract is met by re-running FDMT_reference over the
+  kept input history plus the block.
+  """
+
+  def __init__(self, plan, max_block, dtype='float32'):
+    self.plan, self.max_block, self.dtype = plan, int(max_block), np.dtype(dtype)
+    self._handle = None
+    self._position = 0
+    self._history = None
+    if plan._handle is not None and self.dtype in _NATIVE_DTYPES:
+      handle = ctypes.c_void_p()
+      _check(_native.fdmt_stream_create(plan._handle, self.max_block, _NATIVE_DTYPES[self.dtype],
+                                        ctypes.byref(handle)))
+      self._handle = handle
+
+  def __del__(self):
+    if self._handle is not None and _native is not None:
+      _native.fdmt_stream_destroy(self._handle)
+      self._handle = None
+
+  def __repr__(self):
+    return f'FDMTStream({self.plan}, max_block={self.max_block}, dtype={self.dtype}, position={self.position})'
+
+  @property
+  def position(self):
+    """Samples pushed since creation or the last reset()."""
+    if self._handle is not None:
+      return _native.fdmt_stream_position(self._handle)
+    return self._position
+
+  def reset(self):
+    """Forget the history and start a new series."""
+    if self._handle is not None:
+      _native.fdmt_stream_reset(self._handle)
+    self._position = 0
+    self._history = None
+
+  def push(self, Block):
+    """Transform the next Block [N_f, n]; returns [rows, n] (squeezed like FDMT())."""
+    Block = np.ascontiguousarray(Block, self.dtype)
+    N_f, n = Block.shape
+    if N_f != self.plan.N_f:
+      raise ValueError(f'plan is for {self.plan.N_f} channels, Block has {N_f}')
+    if not 0 < n <= self.max_block:
+      raise ValueError(f'block of {n} samples, expected 1..{self.max_block}')
+    if self._handle is not None:
+      Output = np.empty((1, self.plan.output_rows, n), self.dtype)
+      _check(_native.fdmt_stream_push(self._handle, Block.ctypes.data, n, Output.ctypes.data))
+      return np.squeeze(Output)
+    # Reference path: every output column depends on at most maxDT (plus the
+    # rounding slack of the sub-band split) earlier samples, so the transform
+    # of history+block is exact on the block's columns.
+    keep = self.plan.maxDT + self.plan.N_f
+    window = Block if self._history is None else np.concatenate((self._history, Block), axis=1)
+    self._history = window[:, -keep:]
+    self._position += n
+    Output = self.plan._reference(window, self.dtype)
+    return np.squeeze(Output.reshape(-1, window.shape[1])[:, -n:])
+
+
+class FDMTHybrid:
+  """Multi-resolution FDMT search of delays minDT..maxDT (native samples).
+
+  At high DM the dispersion smear inside one channel is already several samples
+  wide, so full time resolution there buys nothing. The delay range is split into
+  bands; band k runs an FDMTStream on the input scrunched by factors[k] (sums of
+  factors[k] adjacent samples), which costs ~1/factors[k] of a full-resolution FDMT
+  over the same delays. By default factor 2**k starts at the delay where the smear
+  across the lowest channel reaches 2**k samples, up to max_factor.
+
+  push(Block) returns one (DMT, t0) per band: DMT[r, j] is delay bands[k].delays[r]
+  (native samples, ascending, bands contiguous) at native samples
+  t0 + j*factor .. t0 + (j+1)*factor - 1 of the series, counted from reset(start).
+  Samples that do not fill a whole scrunched column wait for the next push.
+  stitch() puts per-band maps back on the native (delay, time) grid. With
+  plan_file, band plans are shared through FDMTPlan.load_or_create(plan_file.xN).
+  """
+
+  def __init__(self, N_f, f_min, f_max, minDT, maxDT, max_block, dtype='float32',
+               max_factor=8, boundaries=None, plan_file=None):
+    self.N_f, self.f_min, self.f_max = int(N_f), float(f_min), float(f_max)
+    self.minDT, self.maxDT, self.dtype = int(minDT), int(maxDT), np.dtype(dtype)
+    if boundaries is None:
+      # Delay across the lowest channel, per sample of total delay
+      deltaF = (self.f_max - self.f_min) / float(self.N_f)
+      smear = (self.f_min**-2 - (self.f_min + deltaF)**-2) / (self.f_min**-2 - self.f_max**-2)
+      boundaries, factor = [], 2
+      while factor <= max_factor:
+        boundaries.append(int(np.ceil(factor / smear)))
+        factor *= 2
+    boundaries = sorted(boundaries)
+    edges = [self.minDT] + [b for b in boundaries if self.minDT < b <= self.maxDT] + [self.maxDT + 1]
+    self.bands = []
+    for lo, hi in zip(edges[:-1], edges[1:]):
+      # Boundary i starts factor 2**(i+1), whether or not minDT has passed it
+      factor = 2**sum(b <= lo for b in boundaries)
+      first, last = -(-lo // factor), (hi - 1) // factor   # rows r with lo <= r*factor < hi
+      if last < first:
+        continue
+      band = _HybridBand()
+      band.factor = factor
+      if plan_file:
+        band.plan = FDMTPlan.load_or_create(f'{plan_file}.x{factor}', self.N_f, self.f_min,
+                                            self.f_max, last + 1, first)
+      else:
+        band.plan = FDMTPlan(self.N_f, self.f_min, self.f_max, last + 1, first)
+      band.rows = last - first + 1                          # plan may give a row or two more
+      band.delays = factor * np.arange(first, last + 1)
+      band.stream = FDMTStream(band.plan, max_block // factor + 1, self.dtype)
+      self.bands.append(band)
+    self.reset()
+
+  def __repr__(self):
+    bands = ', '.join(f'{b.delays[0]}-{b.delays[-1]}/{b.factor}' for b in self.bands)
+    return f'FDMTHybrid(N_f={self.N_f}, f_min={self.f_min}, f_max={self.f_max}, delays/factor: {bands})'
+
+  def reset(self, start=0):
+    """Start a new series whose first sample is sample `start` of the file."""
+    for band in self.bands:
+      band.stream.reset()
+      band.pending = None
+      band.t0 = int(start)
+
+  def push(self, Block):
+    Block = np.asarray(Block)
+    out = []
+    for band in self.bands:
+      f = band.factor
+      data = Block if band.pending is None else np.concatenate((band.pending, Block), axis=1)
+      n = data.shape[1] // f
+      band.pending = data[:, n * f:]
+      t0 = band.t0
+      band.t0 += n * f
+      if n == 0:
+        out.append((np.zeros((band.rows, 0), self.dtype), t0))
+        continue
+      scrunched = data[:, :n * f].reshape(self.N_f, n, f).sum(axis=2, dtype=self.dtype) if f > 1 else data
+      DMT = band.stream.push(scrunched).reshape(-1, n)[:band.rows]
+      out.append((DMT, t0))
+    return out
+
+  def stitch(self, images, t_start, n_t):
+    """Per-band images (one per band, shaped like push()'s DMTs, with their t0)
+    resampled onto native rows minDT..maxDT and columns t_start..t_start+n_t-1."""
+    grid = np.zeros((self.maxDT - self.minDT + 1, n_t), 'float32')
+    t = t_start + np.arange(n_t)
+    for band, (image, t0) in zip(self.bands, images):
+      if image.shape[1] == 0:
+        continue
+      rows = np.arange(band.delays[0], band.delays[-1] + band.factor)
+      rows = rows[(rows >= self.minDT) & (rows <= self.maxDT)]
+      r = np.minimum((rows - band.delays[0] + band.factor // 2) // band.factor, band.rows - 1)
+      c = (t - t0) // band.factor
+      ok = (c >= 0) & (c < image.shape[1])
+      grid[np.ix_(rows - self.minDT, np.nonzero(ok)[0])] = image[np.ix_(r, c[ok])]
+    return grid
+
+
+class _HybridBand:
+  """One delay band of an FDMTHybrid (attributes only)."""
+
+
+@functools.lru_cache(maxsize=8)
+def _cached_plan(N_f, f_min, f_max, maxDT):
+  return FDMTPlan(N_f, f_min, f_max, maxDT)
+
+
+def FDMT_reference(Image, f_min, f_max, maxDT, dtype):
+    """
+    The Fast discrete Dispersion Measure Transform (FDMT) algorithm.
     Input:
       Input power matrix I(f, s)
         dimensions (N_f, N_s), N_f must be a power of 2
@@ -10,7 +10,7 @@ import matplotlib.pyplot as plt
 
 # FDMT kernel lives in fdmt.py; per-channel normalization in preprocess.py.
 # Both must be deployed alongside this script (same dir / ~/bin).
-from fdmt import FDMT
+from fdmt import FDMTHybrid
 from preprocess import normalize_robust
 from detect import boxcar_search
 
@@ -37,21 +37,26 @@ DM_min = 10.0  # Minimum dispersion of interest
 ds_max = int(DM_max * 4148.808 * (f_min**-2 - f_max**-2) / dt)  # Max sample bin shift, from DM_max
 ds_min = int(DM_min * 4148.808 * (f_min**-2 - f_max**-2) / dt)  # Min sample bin shift, from DM_min
 
-N_s = 2**15       # Number of samples per chunk
-overlap_s = 2**13  # Overlap chunks by this amount (must be >= ds_max for gap-free coverage)
-if ds_max > overlap_s:
-  print(f'WARNING: ds_max ({ds_max}) > overlap_s ({overlap_s}): high-DM bursts '
-        f'near chunk boundaries may be missed. Increase overlap_s.')
+N_s = 2**15  # Number of samples per chunk
 
 os.makedirs(f'/users/nfairfie/scratch/results/{fil_prefix}', exist_ok=True)
 
-for i_s in range(0, file_shape[0], N_s - overlap_s):
-  result_filename = f'/users/nfairfie/scratch/results/{fil_prefix}/{fil_filename}_{i_s:010}.png'
-  if os.path.exists(result_filename): continue  # Note: race condition with other workers right here.
-  open(result_filename, 'w')  # write a placeholder to claim this chunk
+# Multi-resolution FDMT over delays ds_min..ds_max: full time resolution for low
+# DMs, and 2x/4x/8x scrunched input for the higher DM bands, where the smear within
+# a channel is already that wide. Rows below ds_min are never computed. The plans
+# depend only on the band and delay range: build them once per observation and
+# share them with the other workers through the results dir.
+# Chunks do not overlap: the streams carry the last ds_max samples of every FDMT
+# level from one chunk into the next, so every output column is complete.
+hybrid = FDMTHybrid(N_f, f_min, f_max, ds_min, ds_max, max(N_s, ds_max), 'float32',
+                    plan_file=f'/users/nfairfie/scratch/results/{fil_prefix}/fdmt.plan')
+print(hybrid)
+next_s = 0  # first sample the streams have not seen yet
 
-  print(f'processing chunk starting at sample {i_s}...')
-  obs = bl.Waterfall(fil_fullname, t_start=i_s, t_stop=(i_s + N_s), max_load=2.0)
+
+def load_block(t_start, t_stop):
+  """Normalized, frequency-ascending block of samples [t_start, t_stop)."""
+  obs = bl.Waterfall(fil_fullname, t_start=t_start, t_stop=t_stop, max_load=2.0)
   D = np.squeeze(obs.data).T
   D = D[f_start:(f_end + 1)]
   chan_freqs = freqs[f_start:(f_end + 1)]
@@ -69,22 +74,49 @@ for i_s in range(0, file_shape[0], N_s - overlap_s):
   # validated in fdmt_validate.py. Sort explicitly instead of assuming the file's
   # channel order -- orientation-proof; replaces the old, ambiguous D[::-1].
   order = np.argsort(chan_freqs)
-  DMT = FDMT(D[order], f_min, f_max, ds_max, 'float32')  # Compute the DMT
-  print(DMT.shape)
-  DMT = DMT[ds_min:, ds_max:]  # Crop off low DMs, and the first ds_max (edge-contaminated) samples
+  return D[order]
+
+
+for i_s in range(0, file_shape[0], N_s):
+  result_filename = f'/users/nfairfie/scratch/results/{fil_prefix}/{fil_filename}_{i_s:010}.png'
+  if os.path.exists(result_filename): continue  # Note: race condition with other workers right here.
+  open(result_filename, 'w')  # write a placeholder to claim this chunk
+
+  print(f'processing chunk starting at sample {i_s}...')
+  if i_s != next_s:
+    # Another worker took the previous chunk: restart the streams on the ds_max
+    # samples before this one, and throw away their (edge-contaminated) output.
+    hybrid.reset(max(0, i_s - ds_max))
+    hybrid.push(load_block(max(0, i_s - ds_max), i_s))
+  D = load_block(i_s, i_s + N_s)
+  DMTs = hybrid.push(D)  # Compute the DMT of each delay band: [(DMT, first sample)]
+  next_s = i_s + N_s
+  print([DMT.shape for DMT, t0 in DMTs])
 
   # Boxcar matched-filter width search: per (DM, time) cell, the best S/N across
   # boxcar widths (robust median/MAD z-score per row+width). Recovers ~sqrt(W) of
   # S/N for width-W pulses that a single-sample statistic would miss, and gives a
-  # robust detection threshold. `best` is the peak candidate.
-  detect, best = boxcar_search(DMT, max_width=64)
+  # robust detection threshold. Each band is searched at its own resolution (same
+  # widths in native samples); `best` is the peak candidate over all bands, with
+  # i_dm, i_t and width converted to native rows (delay - ds_min) and samples.
+  detects, best = [], {'snr': -np.inf, 'i_dm': 0, 'i_t': 0, 'width': 1}
+  for band, (DMT, t0) in zip(hybrid.bands, DMTs):
+    if DMT.shape[1] == 0:
+      detects.append((DMT, t0))
+      continue
+    detect, b = boxcar_search(DMT, max_width=max(1, 64 // band.factor))
+    detects.append((detect, t0))
+    if b['snr'] > best['snr']:
+      best = {'snr': b['snr'], 'i_dm': int(band.delays[b['i_dm']]) - ds_min,
+              'i_t': t0 - i_s + b['i_t'] * band.factor, 'width': b['width'] * band.factor}
 
   if (best['snr'] > 6.0):
+    detect = hybrid.stitch(detects, i_s, D.shape[1])  # rows ds_min..ds_max, native samples
     DM_best = DM_min + (DM_max - DM_min) * best['i_dm'] / max(detect.shape[0] - 1, 1)
-    t_best = (i_s + ds_max + best['i_t']) * dt
+    t_best = (i_s + best['i_t']) * dt
     fig = plt.figure(figsize=(16, 12))
     plt.imshow(detect, cmap='magma', origin='lower', aspect='auto',
-        extent=((i_s + ds_max) * dt, (i_s + ds_max + detect.shape[1]) * dt, DM_min, DM_max))
+        extent=(i_s * dt, (i_s + detect.shape[1]) * dt, DM_min, DM_max))
     plt.colorbar(label='matched-filter S/N')
     plt.plot(t_best, DM_best, 'c+', ms=20, mew=2)  # mark the peak candidate
     plt.ylabel('DM (pc/cm^3)')
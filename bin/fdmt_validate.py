@@ -25,6 +25,12 @@ Each check is pass/fail; the script exits nonzero if any fails.
      f_min arrival and the FDMT peak column, so the plot time axis can be
      checked.
 
+  0. NATIVE ENGINE. When libfdmt.so is built, its FDMT must equal the numpy
+     reference kernel bit-for-bit, for several band layouts, maxDT values and
+     dtypes (skipped, not failed, when the library is absent). A plan saved
+     to disk and loaded back must give the same output again, and a plan's
+     reused (dirty) working buffers must not leak into the next chunk.
+
   5. SENSITIVITY vs DIRECT DEDISPERSION. With fair sub-sample injection, the
      FDMT should recover essentially the same peak S/N as brute-force direct
      dedispersion. Also demonstrates that a boxcar matched to the pulse width
@@ -36,11 +42,15 @@ Usage:
   ./fdmt_validate.py --plot OUT.png
 """
 import argparse
+import copy
+import os
 import sys
+import tempfile
 
 import numpy as np
 
 sys.path.insert(0, __file__.rsplit('/', 1)[0])
+import fdmt
 from fdmt import FDMT
 from preprocess import normalize_robust, normalize_minmax
 from detect import boxcar_search, default_widths
@@ -140,6 +150,174 @@ class Reporter:
 
 
 # --------------------------------------------------------------------------- #
+def test_native_engine(rep, f_min, f_max, N_f, dt, N_s, dm_max, verbose, seed=3):
+    print("\n== Test 0: native engine vs numpy reference (bit-for-bit) ==")
+    if fdmt._native is None:
+        print("   SKIPPED: libfdmt.so not built (make -C fdmt)")
+        return
+    print(f"   inner loops: {fdmt.simd()}")
+    rng = np.random.default_rng(seed)
+    maxDT = dm_to_row(dm_max, f_min, f_max, dt)
+    cases = [(N_f, maxDT, 'float32'), (N_f, N_f, 'float32'), (N_f, maxDT, 'float64'),
+             (64, 200, 'int32'), (16, 37, 'int64'), (2, 5, 'float32'), (16, 37, 'int16'),
+             (N_f, maxDT, 'float16')]
+    for n_f, max_dt, dtype in cases:
+        if dtype == 'int16':
+            Image = rng.integers(-3, 3, size=(n_f, N_s)).astype(dtype)
+        elif np.dtype(dtype).kind == 'i':
+            Image = rng.integers(-100, 100, size=(n_f, N_s)).astype(dtype)
+        else:
+            Image = rng.normal(size=(n_f, N_s)).astype(dtype)
+        ref = fdmt.FDMT_reference(Image, f_min, f_max, max_dt, dtype)
+        nat = fdmt.FDMT_native(Image, f_min, f_max, max_dt, dtype)
+        same = ref.shape == nat.shape and ref.dtype == nat.dtype and np.array_equal(ref, nat)
+        rep.check(same, f"N_f={n_f:>3} maxDT={max_dt:>4} {dtype:>7}: identical output",
+                  f"shape {nat.shape}" if same else
+                  f"shapes {ref.shape}/{nat.shape}, max |diff|="
+                  f"{np.abs(ref.astype('float64') - nat.astype('float64')).max() if ref.shape == nat.shape else 'n/a'}")
+
+    # Integer accumulation of 8-bit samples: the bound from the plan is
+    # reached by an all-255 image, and the dtype it picks gives the int64 sums.
+    for n_f, max_dt in ((16, 37), (N_f, maxDT)):
+        plan = fdmt.FDMTPlan(n_f, f_min, f_max, max_dt)
+        acc = plan.accumulator_dtype(8)
+        full = np.full((n_f, N_s), 255, 'int64')
+        Image = rng.integers(0, 256, size=(n_f, N_s))
+        rep.check(plan(full, 'int64').max() == 255 * plan.max_terms and
+                  np.array_equal(plan(Image, acc), plan(Image, 'int64')),
+                  f"N_f={n_f:>3} maxDT={max_dt:>4}: 8-bit input fits {acc}",
+                  f"at most {plan.max_terms} samples per cell")
+
+    Image = rng.normal(size=(N_f, N_s)).astype('float32')
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, 'fdmt.plan')
+        plan = fdmt.FDMTPlan.load_or_create(path, N_f, f_min, f_max, maxDT)
+        loaded = fdmt.FDMTPlan.load(path)
+        reused = fdmt.FDMTPlan.load_or_create(path, N_f, f_min, f_max, maxDT)
+    rep.check(np.array_equal(plan(Image, 'float32'), loaded(Image, 'float32')),
+              "plan saved to disk and loaded back gives identical output", repr(loaded))
+    rep.check((reused.N_f, reused.maxDT, reused.output_rows) == (N_f, maxDT, plan.output_rows),
+              "load_or_create reuses the saved plan")
+    Image2 = rng.normal(size=(N_f, N_s)).astype('float32')
+    rep.check(np.array_equal(plan(Image2, 'float32'),
+                             fdmt.FDMT_reference(Image2, f_min, f_max, maxDT, 'float32')),
+              "second chunk through the same plan (reused buffers) is exact")
+
+    # A batch of three images through one call, into a caller buffer, is the
+    # same as three calls.
+    Images = rng.normal(size=(3, N_f, N_s)).astype('float32')
+    out = np.empty((3, plan.output_rows, N_s), 'float32')
+    got = plan.batch(Images, 'float32', out=out)
+    rep.check(got is out and all(np.array_equal(out[i], plan(Images[i], 'float32')) for i in range(3)),
+              "batch of 3 images into a caller buffer == 3 single calls")
+
+    # DM_min pruning: the plan's rows start at minDT and match the cropped
+    # full transform, through save/load and the stream too.
+    pruned = fdmt.FDMTPlan.for_dm_range(N_f, f_min, f_max, dt, (dm_max / 20, dm_max))
+    minDT = pruned.minDT
+    full = fdmt.FDMT_reference(Image2, f_min, f_max, pruned.maxDT, 'float32')
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, 'fdmt.plan')
+        pruned.save(path)
+        loaded = fdmt.FDMTPlan.load(path)
+    got = pruned(Image2, 'float32')
+    rep.check(got.shape == (full.shape[0] - minDT, N_s) and np.array_equal(got, full[minDT:]),
+              f"plan for DM {dm_max / 20:.0f}-{dm_max:.0f} (rows {minDT}..{pruned.maxDT}) == full[{minDT}:]",
+              f"shape {got.shape}")
+    rep.check(loaded.minDT == minDT and np.array_equal(loaded(Image2, 'float32'), got),
+              "pruned plan saved and loaded back: identical output", repr(loaded))
+    stream = fdmt.FDMTStream(pruned, N_s // 2, 'float32')
+    halves = [stream.push(Image2[:, :N_s // 2]), stream.push(Image2[:, N_s // 2:])]
+    rep.check(np.array_equal(np.concatenate(halves, axis=1), got), "pruned plan streamed in two halves")
+
+
+def test_streaming(rep, f_min, f_max, N_f, dt, N_s, dm_max, verbose, seed=5):
+    print("\n== Test 0b: streaming FDMT vs one-shot over the whole series ==")
+    rng = np.random.default_rng(seed)
+    maxDT = dm_to_row(dm_max, f_min, f_max, dt)
+    # Irregular blocks, some shorter than maxDT and one of a single sample,
+    # so every history/split boundary is crossed.
+    blocks = [N_s // 2, 1, maxDT // 3, N_s, 17, maxDT + 5, N_s // 3]
+    series = rng.normal(size=(N_f, sum(blocks))).astype('float32')
+    ref = fdmt.FDMT_reference(series, f_min, f_max, maxDT, 'float32')
+    plan = fdmt.FDMTPlan(N_f, f_min, f_max, maxDT)
+    numpy_plan = copy.copy(plan)
+    numpy_plan._handle = None              # parameters only: forces the reference path
+    engines = [('numpy', numpy_plan)] + ([('native', plan)] if fdmt._native is not None else [])
+    for name, p in engines:
+        stream = fdmt.FDMTStream(p, max(blocks), 'float32')
+        out, i = [], 0
+        for n in blocks:
+            out.append(stream.push(series[:, i:i + n]).reshape(ref.shape[0], n))
+            i += n
+        got = np.concatenate(out, axis=1)
+        rep.check(np.array_equal(got, ref), f"{name:>6}: {len(blocks)} blocks concatenated == one-shot",
+                  f"{got.shape}" if got.shape != ref.shape else
+                  f"{np.count_nonzero(got != ref)} cells differ")
+        stream.reset()
+        first = stream.push(series[:, :N_s])
+        rep.check(stream.position == N_s and np.array_equal(first, ref[:, :N_s]),
+                  f"{name:>6}: reset() starts a new series")
+    if fdmt._native is None:
+        print("   native stream SKIPPED: libfdmt.so not built (make -C fdmt)")
+
+
+def test_hybrid(rep, f_min, f_max, N_f, dt, N_s, dm_max, verbose, seed=9):
+    print("\n== Test 0c: time-decimating hybrid FDMT ==")
+    rng = np.random.default_rng(seed)
+    freqs = channel_freqs(f_min, f_max, N_f)
+    maxDT = dm_to_row(dm_max, f_min, f_max, dt)
+    hybrid = fdmt.FDMTHybrid(N_f, f_min, f_max, maxDT // 30, maxDT, N_s)
+    print(f"   {hybrid}")
+    cost = sum(b.rows / b.factor for b in hybrid.bands) / (maxDT - maxDT // 30 + 1)
+    print(f"   output cells vs full resolution: {100 * cost:.0f}%")
+
+    # Each band is exactly the FDMT of its scrunched series, across irregular
+    # blocks that leave samples pending between pushes.
+    blocks = [N_s // 3, 5, maxDT // 2 + 3, N_s]
+    series = rng.normal(size=(N_f, sum(blocks))).astype('float32')
+    out, i = [[] for _ in hybrid.bands], 0
+    for n in blocks:
+        for k, (DMT, t0) in enumerate(hybrid.push(series[:, i:i + n])):
+            out[k].append(DMT)
+        i += n
+    for band, parts in zip(hybrid.bands, out):
+        f, got = band.factor, np.concatenate(parts, axis=1)
+        n = series.shape[1] // f
+        scrunched = series[:, :n * f].reshape(N_f, n, f).sum(axis=2, dtype='float32')
+        ref = fdmt.FDMT_reference(scrunched, f_min, f_max, band.plan.maxDT, 'float32')
+        ref = ref[band.plan.minDT:band.plan.minDT + band.rows]
+        rep.check(np.array_equal(got, ref),
+                  f"band x{f}: delays {band.delays[0]}-{band.delays[-1]} == FDMT of scrunched series",
+                  f"shape {got.shape}")
+
+    # A high-DM pulse comes out at its DM and time on the stitched native grid.
+    DM, t0 = 0.8 * dm_max, (maxDT + N_s) // 2
+    Image = inject_pulse(freqs, N_s, dt, DM, t0, amp=1.0, width=4)
+    hybrid.reset()
+    stitched = hybrid.stitch(hybrid.push(Image), 0, Image.shape[1])
+    r, c = np.unravel_index(int(np.argmax(stitched)), stitched.shape)
+    rec_dm = row_to_dm(r + hybrid.minDT, f_min, f_max, dt)
+    band = [b for b in hybrid.bands if b.delays[0] <= r + hybrid.minDT][-1]
+    rep.check(abs(rec_dm - DM) <= band.factor * row_to_dm(1.5, f_min, f_max, dt) and
+              abs(c - t0) <= 2 * band.factor,
+              f"DM={DM:.0f} pulse found in the x{band.factor} band",
+              f"DM {rec_dm:.1f}, t {c} vs {t0}, peak {stitched[r, c]:.0f}/{4 * N_f}")
+
+    # Starting above the 2-sample-smear delay, the first band is already
+    # scrunched: each band's factor is the smear (in samples, rounded down to
+    # a power of 2, up to 8) across the lowest channel at its first delay.
+    deltaF = (f_max - f_min) / N_f
+    smear = (f_min**-2 - (f_min + deltaF)**-2) / (f_min**-2 - f_max**-2)
+    minDT = int(np.ceil(3 / smear))
+    high = fdmt.FDMTHybrid(N_f, f_min, f_max, minDT, maxDT, N_s)
+    want = [min(8, 2**int(np.floor(np.log2(max(1.0, b.delays[0] * smear)))))
+            for b in high.bands]
+    rep.check([b.factor for b in high.bands] == want and high.bands[0].factor == 2,
+              f"minDT={minDT} (smear 3 samples): bands start at x2 and follow the smear",
+              f"{high}")
+
+
 def test_kernel_correctness(rep, f_min, f_max, N_f, dt, N_s, dm_max, verbose):
     print("\n== Test 1: kernel correctness vs brute-force (low DM, exact) ==")
     freqs = channel_freqs(f_min, f_max, N_f)
@@ -372,6 +550,9 @@ def main():
           f"N_s={args.n_s}, DM_max={args.dm_max} -> maxDT={maxDT} samples")
 
     rep = Reporter()
+    test_native_engine(rep, *p, args.verbose)
+    test_streaming(rep, *p, args.verbose)
+    test_hybrid(rep, *p, args.verbose)
     test_kernel_correctness(rep, *p, args.verbose)
     test_injection_recovery(rep, *p, args.verbose)
     test_orientation(rep, *p, args.verbose)
@@ -14,6 +14,34 @@ then
 	exit
 fi
 
+# Files of a set converted in parallel; leave at 1 while the machine is
+# recording, e.g. FITS2FIL_THREADS=24 when it isn't.  Only uncompressed,
+# unscaled files are read in parallel; others are read one at a time.
+THREADS=${FITS2FIL_THREADS:-1}
+JOBS=""
+if [ $THREADS -gt 1 ]; then JOBS="-j$THREADS"; fi
+
+# Polarization products summed into each sample, e.g. FITS2FIL_PRODUCTS=I
+# for AA+BB; unset keeps the first product only, as before.
+PRODUCTS=""
+if [ -n "$FITS2FIL_PRODUCTS" ]; then PRODUCTS="-p$FITS2FIL_PRODUCTS"; fi
+
+# Samples and channels added into one while converting (instead of a
+# separate decimate pass), e.g. FITS2FIL_TDEC=4 FITS2FIL_FDEC=2.
+DECIMATE="-t${FITS2FIL_TDEC:-1} -f${FITS2FIL_FDEC:-1}"
+
+# Observation still being recorded: follow its files until none has grown
+# for this many seconds, e.g. FITS2FIL_FOLLOW=600.
+FOLLOW=""
+if [ -n "$FITS2FIL_FOLLOW" ]; then FOLLOW="-F$FITS2FIL_FOLLOW"; fi
+
+# Bandwidth limits next to a capture: FITS2FIL_MBS=50 (read:write MB/s,
+# e.g. 50:20), FITS2FIL_DISK=sdb:20 to back off while the recorder's disk
+# takes over 20 ms per write (only with FITS2FIL_MBS: it slows those rates).
+LIMITS=""
+if [ -n "$FITS2FIL_MBS" ]; then LIMITS="-b$FITS2FIL_MBS"; fi
+if [ -n "$FITS2FIL_DISK" ]; then LIMITS="$LIMITS -B$FITS2FIL_DISK"; fi
+
 SCRATCH_PATH=~/scratch/fil
 echo "SCRATCH_PATH=$SCRATCH_PATH"
 mkdir -p $SCRATCH_PATH
@@ -35,7 +63,7 @@ do
 	fi
 	
 	#nice ~/bin/psrfits2fil $fits
-	ionice --class 3 nice ~/bin/psrfits2fil $fits 695 950
+	ionice --class 3 nice ~/bin/psrfits2fil $JOBS $PRODUCTS $DECIMATE $FOLLOW $LIMITS $fits 695 950
 	#nice ~/bin/psrfits2fil $fits 695 950
 	#nice ~/bin/psrfits2fil $fits 747 910
 	#nice ~/bin/psrfits2fil $fits 747 911
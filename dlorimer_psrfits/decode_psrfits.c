@@ -0,0 +1,256 @@
+/* decode_psrfits.c
+ * Calibrated search-mode samples: the raw DATA of a subint with the
+ * per-channel DAT_SCL, DAT_OFFS and DAT_WTS of that row applied,
+ *
+ *     out = ((raw - ZERO_OFF) * DAT_SCL + DAT_OFFS) * DAT_WTS
+ *
+ * as float32, or requantised back to 8 bits with a fixed gain and
+ * offset so that the backend's per-row rescaling no longer shows up as
+ * steps in the data.  psrfits_read_subint calls this when pf->decode is
+ * set; the result goes to sub->decoded, [nsblk][npol][nchan] like DATA.
+ *
+ * 1-, 2- and 4-bit DATA is first unpacked to one byte per sample
+ * (psrfits_unpack_subint), which psrfits_read_subint always does, so
+ * both the raw and the decoded output see 8-bit samples.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "psrfits.h"
+
+// The samples of each possible byte, first sample in the most
+// significant bits, for 1 ([0]), 2 ([1]) and 4 ([2]) bits per sample
+static unsigned char unpack_table[3][256][8];
+static pthread_once_t unpack_once = PTHREAD_ONCE_INIT;
+
+static void unpack_init(void) {
+    int b, k, i;
+    for (k = 0; k < 3; k++) {
+        int nbits = 1 << k, per_byte = 8 / nbits, mask = (1 << nbits) - 1;
+        for (b = 0; b < 256; b++)
+            for (i = 0; i < per_byte; i++)
+                unpack_table[k][b][i] = (b >> (8 - nbits * (i + 1))) & mask;
+    }
+}
+
+/* One byte per sample from the packed 1-, 2- or 4-bit DATA of the
+ * current subint, into sub->unpacked; data8 then points there and
+ * data_bytes is the unpacked size.
+ */
+int psrfits_unpack_subint(struct psrfits *pf) {
+
+    struct hdrinfo *hdr = &(pf->hdr);
+    struct subint *sub = &(pf->sub);
+    const unsigned char *in = sub->data8;
+    size_t nbytes = sub->bytes_per_subint, i;
+    size_t n = nbytes * (8 / hdr->nbits);
+    unsigned char *out;
+
+    pthread_once(&unpack_once, unpack_init);
+    if (n > sub->unpacked_size) {
+        free(sub->unpacked);
+        sub->unpacked_size = 0;
+        if (posix_memalign((void **)&(sub->unpacked), 64, n) != 0) {
+            sub->unpacked = NULL;
+            return pf->status = MEMORY_ALLOCATION;
+        }
+        sub->unpacked_size = n;
+    }
+    out = sub->unpacked;
+
+    // A fixed-size copy per byte: a single 8-, 4- or 2-byte store
+    switch (hdr->nbits) {
+    case 1:
+        for (i = 0; i < nbytes; i++) memcpy(out + 8 * i, unpack_table[0][in[i]], 8);
+        break;
+    case 2:
+        for (i = 0; i < nbytes; i++) memcpy(out + 4 * i, unpack_table[1][in[i]], 4);
+        break;
+    case 4:
+        for (i = 0; i < nbytes; i++) memcpy(out + 2 * i, unpack_table[2][in[i]], 2);
+        break;
+    default:
+        fprintf(stderr, "Error: can't unpack %d-bit data\n", hdr->nbits);
+        return pf->status = BAD_DATATYPE;
+    }
+    sub->data8 = out;
+    sub->data16 = NULL;
+    sub->data_bytes = n;
+    return 0;
+}
+
+// Samples per pass of the inner loops: one SSE register, which every
+// x86-64 has.  GCC vector extensions, so this still builds elsewhere.
+#define DECODE_WIDTH 4
+typedef float v4f __attribute__((vector_size(4 * DECODE_WIDTH)));
+typedef int v4i __attribute__((vector_size(4 * DECODE_WIDTH)));
+
+// Lane-wise max and min (C has no ?: on vectors)
+static inline v4f vmax(v4f a, v4f b) {
+    v4i m = a < b;
+    return (v4f)(((v4i)a & ~m) | ((v4i)b & m));
+}
+
+static inline v4f vmin(v4f a, v4f b) {
+    v4i m = a > b;
+    return (v4f)(((v4i)a & ~m) | ((v4i)b & m));
+}
+
+// Make sure the decode buffers hold n samples
+static int decode_buffers(struct subint *sub, int nchan, int npol, size_t n) {
+
+    size_t need = n * sizeof(float);
+    size_t nivals = (size_t)nchan * npol;
+
+    if (need > sub->decoded_size) {
+        free(sub->decoded);
+        sub->decoded_size = 0;
+        if (posix_memalign(&(sub->decoded), 64, need) != 0) {
+            sub->decoded = NULL;
+            return MEMORY_ALLOCATION;
+        }
+        sub->decoded_size = need;
+    }
+    if (nivals * 2 > sub->decode_nvals) {
+        free(sub->decode_gain);
+        sub->decode_nvals = 0;
+        sub->decode_gain = (float *)malloc(sizeof(float) * 2 * nivals);
+        if (!sub->decode_gain) { return MEMORY_ALLOCATION; }
+        sub->decode_nvals = nivals * 2;
+    }
+    return 0;
+}
+
+// Raw samples of one spectrum (nivals of them) as floats
+static void raw_spectrum(const struct subint *sub, int nbits, size_t first,
+                         size_t nivals, float *out) {
+    size_t i;
+    if (nbits <= 8) {
+        // Also 1, 2 and 4 bits, unpacked by psrfits_read_subint
+        const unsigned char *in = sub->data8 + first;
+        for (i = 0; i < nivals; i++) out[i] = in[i];
+    } else {
+        // 16-bit DATA is big-endian, signed
+        const unsigned char *in = (const unsigned char *)sub->data16 + 2 * first;
+        for (i = 0; i < nivals; i++)
+            out[i] = (short)((in[2 * i] << 8) | in[2 * i + 1]);
+    }
+}
+
+/* Fill sub->decoded from the raw DATA of the current subint, as float32
+ * (PSRFITS_DECODE_FLOAT) or as 8-bit
+ * clamp(out * pf->requant_gain + pf->requant_offset, 0, 255), rounded
+ * (PSRFITS_DECODE_8BIT).
+ */
+int psrfits_decode_subint(struct psrfits *pf) {
+
+    struct hdrinfo *hdr = &(pf->hdr);
+    struct subint *sub = &(pf->sub);
+    size_t nivals = (size_t)hdr->nchan * hdr->npol;
+    size_t n = nivals * hdr->nsblk;
+    size_t i, t;
+    float *gain, *offset;
+    float *raw;
+
+    if (hdr->nbits != 1 && hdr->nbits != 2 && hdr->nbits != 4 &&
+        hdr->nbits != 8 && hdr->nbits != 16) {
+        fprintf(stderr, "Error: can't decode %d-bit data\n", hdr->nbits);
+        return pf->status = BAD_DATATYPE;
+    }
+    if (decode_buffers(sub, hdr->nchan, hdr->npol, n) != 0)
+        return pf->status = MEMORY_ALLOCATION;
+
+    // out = raw * gain + offset for each chan * pol of this row
+    gain = sub->decode_gain;
+    offset = gain + nivals;
+    for (i = 0; i < nivals; i++) {
+        float wt = sub->dat_weights[i % hdr->nchan];
+        gain[i] = sub->dat_scales[i] * wt;
+        offset[i] = (sub->dat_offsets[i] - hdr->zero_off * sub->dat_scales[i]) * wt;
+    }
+    if (pf->decode == PSRFITS_DECODE_8BIT) {
+        // Fold the requantisation into the same multiply-add
+        for (i = 0; i < nivals; i++) {
+            gain[i] *= pf->requant_gain;
+            offset[i] = offset[i] * pf->requant_gain + pf->requant_offset;
+        }
+    }
+
+    // Each spectrum is unpacked as floats into its place in the output
+    // and scaled there.  8-bit output for spectrum t ends before byte
+    // 4 * t * nivals, where its floats start, and each vector's store lands
+    // below the floats still to be read, so the two can share the buffer.
+    for (t = 0; t < (size_t)hdr->nsblk; t++) {
+        float *out = (float *)sub->decoded + t * nivals;
+        raw = out;
+        raw_spectrum(sub, hdr->nbits, t * nivals, nivals, raw);
+        if (pf->decode == PSRFITS_DECODE_FLOAT) {
+            for (i = 0; i + DECODE_WIDTH <= nivals; i += DECODE_WIDTH) {
+                v4f x, g, o;
+                memcpy(&x, raw + i, sizeof(x));
+                memcpy(&g, gain + i, sizeof(g));
+                memcpy(&o, offset + i, sizeof(o));
+                x = x * g + o;
+                memcpy(out + i, &x, sizeof(x));
+            }
+            for (; i < nivals; i++) out[i] = raw[i] * gain[i] + offset[i];
+        } else {
+            unsigned char *q = (unsigned char *)sub->decoded + t * nivals;
+            const v4f lo = {0}, hi = lo + 255.0f, half = lo + 0.5f;
+            for (i = 0; i + DECODE_WIDTH <= nivals; i += DECODE_WIDTH) {
+                v4f x, g, o;
+                int k;
+                memcpy(&x, raw + i, sizeof(x));
+                memcpy(&g, gain + i, sizeof(g));
+                memcpy(&o, offset + i, sizeof(o));
+                x = x * g + o;
+                x = vmin(vmax(x, lo), hi);
+                v4i r = __builtin_convertvector(x + half, v4i);
+                for (k = 0; k < DECODE_WIDTH; k++) q[i + k] = (unsigned char)r[k];
+            }
+            for (; i < nivals; i++) {
+                float x = raw[i] * gain[i] + offset[i];
+                q[i] = x <= 0.0f ? 0 : x >= 255.0f ? 255 : (unsigned char)(x + 0.5f);
+            }
+        }
+    }
+    return 0;
+}
+
+/* out = clamp(in * gain + offset, 0, 255), rounded, for n samples: the
+ * 8-bit requantisation of psrfits_decode_subint for floats formed
+ * elsewhere (e.g. sums of polarizations).
+ */
+void psrfits_requant8(unsigned char *out, const float *in, size_t n,
+                      float gain, float offset) {
+
+    const v4f lo = {0}, hi = lo + 255.0f, half = lo + 0.5f;
+    const v4f g = lo + gain, o = lo + offset;
+    size_t i;
+    int k;
+
+    for (i = 0; i + DECODE_WIDTH <= n; i += DECODE_WIDTH) {
+        v4f x;
+        memcpy(&x, in + i, sizeof(x));
+        x = vmin(vmax(x * g + o, lo), hi);
+        v4i r = __builtin_convertvector(x + half, v4i);
+        for (k = 0; k < DECODE_WIDTH; k++) out[i + k] = (unsigned char)r[k];
+    }
+    for (; i < n; i++) {
+        float x = in[i] * gain + offset;
+        out[i] = x <= 0.0f ? 0 : x >= 255.0f ? 255 : (unsigned char)(x + 0.5f);
+    }
+}
+
+void psrfits_free_decoded(struct subint *sub) {
+    free(sub->decoded);
+    free(sub->decode_gain);
+    free(sub->unpacked);
+    sub->unpacked = NULL;
+    sub->unpacked_size = 0;
+    sub->decoded = NULL;
+    sub->decode_gain = NULL;
+    sub->decoded_size = 0;
+    sub->decode_nvals = 0;
+}
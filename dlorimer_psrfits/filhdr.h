@@ -0,0 +1,35 @@
+/* filhdr.h
+ * A SIGPROC filterbank header built in memory and written with one call
+ * (see send_stuff.c).  No global state: any number of them can be in
+ * use at once, by any thread.
+ */
+#ifndef FILHDR_H
+#define FILHDR_H
+
+#include <stdio.h>
+
+/* Byte order of this machine, known at compile time */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define FILHDR_BIG_ENDIAN 1
+#else
+#define FILHDR_BIG_ENDIAN 0
+#endif
+
+struct filhdr {
+  unsigned char *buf;   /* the header so far */
+  size_t len, size;     /* bytes in buf, allocated */
+  int swap;             /* numbers in the other byte order */
+  int status;           /* 0, or -1 once out of memory */
+};
+
+void filhdr_init(struct filhdr *h, int swap);
+void filhdr_free(struct filhdr *h);
+void filhdr_string(struct filhdr *h, const char *string);
+void filhdr_int(struct filhdr *h, const char *name, int integer);
+void filhdr_long(struct filhdr *h, const char *name, long integer);
+void filhdr_float(struct filhdr *h, const char *name, float floating_point);
+void filhdr_double(struct filhdr *h, const char *name, double double_precision);
+void filhdr_coords(struct filhdr *h, double raj, double dej, double az, double za);
+int filhdr_write(const struct filhdr *h, FILE *fp);
+
+#endif
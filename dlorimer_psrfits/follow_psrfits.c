@@ -0,0 +1,154 @@
+/* follow_psrfits.c
+ * Reading a PSRFITS file set while it is still being recorded.
+ *
+ * With pf->follow set, psrfits_read_subint does not stop at the end of
+ * the rows it knows about but calls psrfits_follow, which reopens the
+ * file to pick up rows added since (NAXIS2, less any row not yet on disk
+ * in full), moves on to the next file of the set once that has appeared,
+ * and otherwise sleeps until something in the directory changes --
+ * giving up after pf->follow seconds without a new row.  Changes are
+ * watched with inotify where there is one (a local disk); elsewhere, and
+ * on network filesystems that never report changes, the files are looked
+ * at every PSRFITS_FOLLOW_POLL seconds anyway.  A byte written to
+ * pf->follow_wake (see psrfits_prefetch_stop) ends the wait at once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "psrfits.h"
+
+// However busy the writer is, look at the files at most once a second
+#define PSRFITS_FOLLOW_INTERVAL 1
+// ...and at least this often, in case no change is reported
+#define PSRFITS_FOLLOW_POLL 10
+
+// Close the open file, if any
+static void follow_close(struct psrfits *pf) {
+    int status = 0;
+    if (!pf->fptr) { return; }
+    psrfits_unmap(pf);
+    fits_close_file(pf->fptr, &status);
+    pf->fptr = NULL;
+}
+
+// Open file filenum at row `row`; 0 if that row is there to read.  With
+// again set (the file already being read) it isn't announced again.
+static int follow_open(struct psrfits *pf, int filenum, int row, int again) {
+    int quiet = pf->quiet, status;
+    pf->quiet = quiet || again;
+    follow_close(pf);
+    pf->filenum = filenum;
+    pf->status = 0;
+    status = psrfits_open(pf);
+    pf->quiet = quiet;
+    if (status != 0) {
+        follow_close(pf);
+        return -1;
+    }
+    pf->rownum = row;
+    return row <= pf->rows_per_file ? 0 : -1;
+}
+
+// Sleep up to ms, or until the directory changes (watch, if >= 0); 1 if
+// woken through pf->follow_wake instead
+static int follow_sleep(struct psrfits *pf, int watch, int ms) {
+    struct pollfd p[2];
+    int n = 0;
+
+    if (pf->follow_wake) {
+        p[n].fd = *pf->follow_wake;
+        p[n].events = POLLIN;
+        p[n++].revents = 0;
+    }
+    if (watch >= 0) {
+        p[n].fd = watch;
+        p[n].events = POLLIN;
+        p[n++].revents = 0;
+    }
+    if (poll(p, n, ms) <= 0) { return 0; }
+    if (pf->follow_wake && (p[0].revents & POLLIN)) { return 1; }
+    if (watch >= 0 && (p[n - 1].revents & POLLIN)) {
+        char events[4096];
+        while (read(watch, events, sizeof(events)) > 0)
+            ;
+    }
+    return 0;
+}
+
+/* Wait for row pf->rownum of the open file, or the first of the next
+ * file, to be written.  On success the reader is positioned to read it;
+ * otherwise, after pf->follow seconds without one (or on a wake-up
+ * through pf->follow_wake), the status is FILE_NOT_OPENED, as at the end
+ * of a set that isn't growing.
+ */
+int psrfits_follow(struct psrfits *pf) {
+
+    int filenum = pf->filenum, row = pf->rownum, watch = -1;
+    time_t start = time(NULL);
+    char dir[1024], name[1024], next[1024];
+    struct stat st, seen;
+
+    // Only reopen (and reparse) a file that has changed since last time
+    memset(&seen, 0, sizeof(seen));
+    seen.st_size = -1;
+    strcpy(name, pf->filename);
+    if (snprintf(next, sizeof(next), "%s_%04d.fits", pf->basefilename,
+                 filenum + 1) >= (int)sizeof(next)) {
+        fprintf(stderr, "Error: file name too long: %s_%04d.fits\n",
+                pf->basefilename, filenum + 1);
+        return pf->status = FILE_NOT_OPENED;
+    }
+
+#ifdef __linux__
+    strcpy(dir, name);
+    watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch >= 0 && inotify_add_watch(watch, dirname(dir),
+                IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO) < 0) {
+        close(watch);
+        watch = -1;
+    }
+#endif
+
+    for (;;) {
+        // More rows of this file, else the next file once it has one
+        int found = 0;
+        if (stat(name, &st) == 0 && (st.st_size != seen.st_size ||
+                st.st_mtim.tv_sec != seen.st_mtim.tv_sec ||
+                st.st_mtim.tv_nsec != seen.st_mtim.tv_nsec)) {
+            seen = st;
+            found = follow_open(pf, filenum, row, 1) == 0;
+        }
+        if (!found && access(next, R_OK) == 0)
+            found = follow_open(pf, filenum + 1, 1, 0) == 0;
+        if (found) {
+            if (watch >= 0) close(watch);
+            return pf->status = 0;
+        }
+        int left = pf->follow - (int)(time(NULL) - start);
+        if (left <= 0) { break; }
+
+        // Sleep until the directory changes (or a while)
+        int wait = left < PSRFITS_FOLLOW_POLL ? left : PSRFITS_FOLLOW_POLL;
+        if (watch >= 0) {
+            if (follow_sleep(pf, watch, wait * 1000) ||
+                // let a burst of writes settle
+                follow_sleep(pf, -1, PSRFITS_FOLLOW_INTERVAL * 1000)) { break; }
+        } else if (follow_sleep(pf, -1, wait * 1000)) {
+            break;
+        }
+    }
+
+    if (watch >= 0) close(watch);
+    follow_close(pf);
+    pf->filenum = filenum;
+    pf->rownum = row;
+    return pf->status = FILE_NOT_OPENED;
+}
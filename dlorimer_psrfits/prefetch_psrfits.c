@@ -0,0 +1,319 @@
+/* prefetch_psrfits.c
+ * Background reading of a PSRFITS file set.
+ *
+ * psrfits_prefetch_start hands the open file set over to a reader thread
+ * that runs psrfits_read_subint ahead of the consumer into a ring of
+ * slots, so opening and parsing the next file and the reads themselves
+ * overlap with whatever the consumer does with the previous subints.
+ * psrfits_prefetch_read then behaves like psrfits_read_subint.
+ *
+ * Subints change hands without copying their samples where they can: a
+ * slot points at mapped DATA, keeping that file's mapping until no slot
+ * uses it any more, and the unpacked and decoded buffers are swapped
+ * between the reader and the slot.  Only DATA read through CFITSIO into
+ * the reader's own buffer is copied.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "psrfits.h"
+
+// A file mapping the reader has let go of but slots may still point into
+struct prefetch_map {
+    unsigned char *base;    // NULL: entry free
+    size_t len;
+    int refs;               // Filled slots pointing into it
+};
+
+struct prefetch_slot {
+    struct hdrinfo hdr;     // The header of the file the subint came from
+    struct subint sub;      // Own dat_ arrays and unpacked/decoded buffers
+    int map;                // The entry of maps data8 points into, or -1
+    unsigned char *data;    // Else a copy of the raw data
+    size_t size;            // Bytes allocated at data
+    char filename[1024];
+    long long N;
+    double T;
+    int filenum, rownum, tot_rows, rows_per_file;
+};
+
+struct psrfits_prefetch {
+    struct psrfits reader;  // Owned by the thread once started
+    struct prefetch_slot *slots;
+    int nslots;
+    struct prefetch_map *maps; // nmaps entries
+    int nmaps;
+    int head;               // The slot the consumer has (or gets next)
+    int count;              // Filled slots, including the consumer's
+    int held;               // Does the consumer hold slot head?
+    int done;               // The reader has stopped...
+    int status;             // ...with this status
+    int stop;               // Asked to stop
+    int wake[2];            // Pipe written on stop, for a reader in psrfits_follow
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled, emptied;
+};
+
+// Swap a buffer and its size between the reader and a slot
+#define PREFETCH_SWAP(a, b, type) do { type t_ = (a); (a) = (b); (b) = t_; } while (0)
+
+static void *prefetch_thread(void *arg) {
+
+    struct psrfits_prefetch *p = (struct psrfits_prefetch *)arg;
+    struct psrfits *pf = &(p->reader);
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->count == p->nslots && !p->stop)
+            pthread_cond_wait(&p->emptied, &p->lock);
+        int stop = p->stop;
+        struct prefetch_slot *s = &(p->slots[(p->head + p->count) % p->nslots]);
+
+        // Unmap what neither the reader nor any slot uses any more
+        unsigned char *unmap[p->nmaps];
+        size_t unmap_len[p->nmaps];
+        int nunmap = 0;
+        for (i = 0; i < p->nmaps; i++)
+            if (p->maps[i].base && p->maps[i].refs == 0 &&
+                p->maps[i].base != pf->map) {
+                unmap[nunmap] = p->maps[i].base;
+                unmap_len[nunmap++] = p->maps[i].len;
+                p->maps[i].base = NULL;
+            }
+        pthread_mutex_unlock(&p->lock);
+        for (i = 0; i < nunmap; i++) munmap(unmap[i], unmap_len[i]);
+        if (stop) { break; }
+
+        // The consumer never touches a slot outside [head, head + count)
+        if (psrfits_read_subint(pf) == 0 && psrfits_copy_subint(&(s->sub), &(pf->sub)) != 0)
+            pf->status = MEMORY_ALLOCATION;
+        if (pf->status) {
+            pthread_mutex_lock(&p->lock);
+            p->status = pf->status;
+            p->done = 1;
+            pthread_cond_signal(&p->filled);
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        s->hdr = pf->hdr;
+        PREFETCH_SWAP(s->sub.decoded, pf->sub.decoded, void *);
+        PREFETCH_SWAP(s->sub.decoded_size, pf->sub.decoded_size, size_t);
+
+        // Where the samples are: the mapped file, the unpacked buffer
+        // (swapped like the decoded one) or the reader's buffer (copied)
+        s->map = -1;
+        if (pf->map && pf->sub.data8 >= pf->map && pf->sub.data8 < pf->map + pf->map_len) {
+            pthread_mutex_lock(&p->lock);
+            for (i = 0; i < p->nmaps && p->maps[i].base != pf->map; i++)
+                ;
+            if (i == p->nmaps)
+                for (i = 0; i < p->nmaps && p->maps[i].base; i++)
+                    ;
+            if (i < p->nmaps) {
+                p->maps[i].base = pf->map;
+                p->maps[i].len = pf->map_len;
+                p->maps[i].refs++;
+                s->map = i;
+            }
+            pthread_mutex_unlock(&p->lock);
+        }
+        if (s->map < 0 && pf->sub.data8 == pf->sub.unpacked) {
+            PREFETCH_SWAP(s->sub.unpacked, pf->sub.unpacked, unsigned char *);
+            PREFETCH_SWAP(s->sub.unpacked_size, pf->sub.unpacked_size, size_t);
+            s->sub.data8 = s->sub.unpacked;
+        } else if (s->map < 0) {
+            size_t bytes = pf->sub.data_bytes;
+            if (bytes > s->size) {
+                free(s->data);
+                s->data = malloc(bytes);
+                s->size = s->data ? bytes : 0;
+                if (!s->data) {
+                    pthread_mutex_lock(&p->lock);
+                    p->status = MEMORY_ALLOCATION;
+                    p->done = 1;
+                    pthread_cond_signal(&p->filled);
+                    pthread_mutex_unlock(&p->lock);
+                    return NULL;
+                }
+            }
+            memcpy(s->data, pf->sub.data8, bytes);
+            s->sub.data8 = s->data;
+        }
+        s->sub.data16 = (unsigned short *)s->sub.data8;
+        s->sub.data_buf = NULL;
+        s->sub.data_bufsize = 0;
+        strcpy(s->filename, pf->filename);
+        s->N = pf->N;
+        s->T = pf->T;
+        s->filenum = pf->filenum;
+        s->rownum = pf->rownum;
+        s->tot_rows = pf->tot_rows;
+        s->rows_per_file = pf->rows_per_file;
+
+        pthread_mutex_lock(&p->lock);
+        p->count++;
+        pthread_cond_signal(&p->filled);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+/* The reader is done with a file mapping: unmap it now unless slots
+ * still point into it (then the reader thread does, once they don't).
+ */
+void psrfits_prefetch_unmap(struct psrfits_prefetch *p, unsigned char *map, size_t len) {
+
+    int i, busy = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i < p->nmaps; i++)
+        if (p->maps[i].base == map) {
+            busy = p->maps[i].refs > 0;
+            if (!busy) p->maps[i].base = NULL;
+        }
+    pthread_mutex_unlock(&p->lock);
+    if (!busy) munmap(map, len);
+}
+
+/* Start reading ahead up to nslots subints of the file set opened in pf
+ * with psrfits_open.  From here on, read it only with
+ * psrfits_prefetch_read until psrfits_prefetch_stop.
+ */
+int psrfits_prefetch_start(struct psrfits *pf, int nslots) {
+
+    struct psrfits_prefetch *p;
+
+    if (nslots < 2) nslots = 2;  // one for the consumer, one being read
+    p = (struct psrfits_prefetch *)calloc(1, sizeof(*p));
+    if (p) p->slots = (struct prefetch_slot *)calloc(nslots, sizeof(*p->slots));
+    // Every slot in a different file, plus the reader's and spares
+    if (p) p->maps = (struct prefetch_map *)calloc(2 * nslots + 2, sizeof(*p->maps));
+    if (!p || !p->slots || !p->maps) {
+        if (p) free(p->slots);
+        free(p);
+        return pf->status = MEMORY_ALLOCATION;
+    }
+    p->nslots = nslots;
+    p->nmaps = 2 * nslots + 2;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->filled, NULL);
+    pthread_cond_init(&p->emptied, NULL);
+
+    // The open file, its mapping and the buffers move to the thread
+    p->reader = *pf;
+    p->reader.prefetch = NULL;
+    p->reader.map_owner = p;  // mappings are unmapped here, once unused
+    // A reader following a growing set may be waiting for it for minutes
+    if (pipe(p->wake) == 0) {
+        p->reader.follow_wake = &(p->wake[0]);
+    } else {
+        p->wake[0] = p->wake[1] = -1;
+    }
+    memset(&(pf->sub), 0, sizeof(pf->sub));
+    pf->fptr = NULL;
+    pf->map = NULL;
+    pf->map_len = 0;
+
+    if (pthread_create(&p->thread, NULL, prefetch_thread, p) != 0) {
+        *pf = p->reader;
+        pf->map_owner = NULL;
+        pf->follow_wake = NULL;
+        if (p->wake[0] >= 0) {
+            close(p->wake[0]);
+            close(p->wake[1]);
+        }
+        free(p->maps);
+        free(p->slots);
+        free(p);
+        return pf->status = MEMORY_ALLOCATION;
+    }
+    pf->prefetch = p;
+    return 0;
+}
+
+/* The next subint, as psrfits_read_subint would return it.  The data
+ * and dat_ arrays stay valid until the next call.
+ */
+int psrfits_prefetch_read(struct psrfits *pf) {
+
+    struct psrfits_prefetch *p = pf->prefetch;
+    struct prefetch_slot *s;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->held) {
+        // Done with the previous one (and maybe its file's mapping)
+        if (p->slots[p->head].map >= 0) p->maps[p->slots[p->head].map].refs--;
+        p->head = (p->head + 1) % p->nslots;
+        p->count--;
+        p->held = 0;
+        pthread_cond_signal(&p->emptied);
+    }
+    while (p->count == 0 && !p->done)
+        pthread_cond_wait(&p->filled, &p->lock);
+    if (p->count == 0) {
+        pf->status = p->status;
+        pthread_mutex_unlock(&p->lock);
+        return pf->status;
+    }
+    p->held = 1;
+    s = &(p->slots[p->head]);
+    pthread_mutex_unlock(&p->lock);
+
+    pf->hdr = s->hdr;
+    pf->sub = s->sub;
+    strcpy(pf->filename, s->filename);
+    pf->N = s->N;
+    pf->T = s->T;
+    pf->filenum = s->filenum;
+    pf->rownum = s->rownum;
+    pf->tot_rows = s->tot_rows;
+    pf->rows_per_file = s->rows_per_file;
+    pf->status = 0;
+    return 0;
+}
+
+/* Stop the reader thread and close whatever file it has open. */
+void psrfits_prefetch_stop(struct psrfits *pf) {
+
+    struct psrfits_prefetch *p = pf->prefetch;
+    int i, status = 0;
+
+    if (!p) { return; }
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_signal(&p->emptied);
+    pthread_mutex_unlock(&p->lock);
+    if (p->wake[1] >= 0 && write(p->wake[1], "", 1) != 1)
+        perror("psrfits_prefetch_stop");
+    pthread_join(p->thread, NULL);
+    if (p->wake[0] >= 0) {
+        close(p->wake[0]);
+        close(p->wake[1]);
+    }
+
+    if (p->reader.fptr) fits_close_file(p->reader.fptr, &status);
+    for (i = 0; i < p->nmaps; i++)
+        if (p->maps[i].base && p->maps[i].base != p->reader.map)
+            munmap(p->maps[i].base, p->maps[i].len);
+    p->reader.map_owner = NULL;
+    p->reader.follow_wake = NULL;
+    psrfits_free_data(&(p->reader));
+    for (i = 0; i < p->nslots; i++) {
+        free(p->slots[i].data);
+        psrfits_free_subint(&(p->slots[i].sub));
+        psrfits_free_decoded(&(p->slots[i].sub));
+    }
+    pthread_cond_destroy(&p->filled);
+    pthread_cond_destroy(&p->emptied);
+    pthread_mutex_destroy(&p->lock);
+    free(p->maps);
+    free(p->slots);
+    free(p);
+    pf->prefetch = NULL;
+    memset(&(pf->sub), 0, sizeof(pf->sub));  // all pointed into the slots
+}
@@ -1,6 +1,7 @@
 /* psrfits.h */
 #ifndef _PSRFITS_H
 #define _PSRFITS_H
+#include <pthread.h>
 #include "fitsio.h"
 #include "polyco.h"
 
@@ -56,6 +57,7 @@ struct hdrinfo {
     int summed_polns;       // Are polarizations summed? (1=Yes, 0=No)
     int rcvr_polns;         // Number of polns provided by the receiver
     int offset_subint;      // Offset subint number for first row in the file
+    double zero_off;        // Zero offset of unsigned raw samples (ZERO_OFF, or 0)
 };
 
 struct subint {
@@ -73,14 +75,47 @@ struct subint {
     double tel_zen;         // Telescope zenith angle at subint centre (deg)
     int bytes_per_subint;   // Number of bytes for one row of raw data
     int FITS_typecode;      // FITS data typecode as per CFITSIO
-    float dat_freqs[16384];       // Ptr to array of Centre freqs for each channel (MHz)
-    float dat_weights[16384];     // Ptr to array of Weights for each channel
-    float dat_offsets[16384];     // Ptr to array of offsets for each chan * pol
-    float dat_scales[16384];      // Ptr to array of Centre freqs for each channel (MHz)
-    unsigned char *data8;    // Ptr to the raw data itself
-    unsigned short *data16;    // Ptr to the raw data itself
+    float *dat_freqs;       // Ptr to array of Centre freqs for each channel (MHz)
+    float *dat_weights;     // Ptr to array of Weights for each channel
+    float *dat_offsets;     // Ptr to array of offsets for each chan * pol
+    float *dat_scales;      // Ptr to array of scales for each chan * pol
+    int dat_nchan;          // Channels the dat_ arrays hold (psrfits_alloc_subint)
+    int dat_npol;           // Polarizations the dat_ arrays hold
+    unsigned char *data8;    // Ptr to the raw data itself (read-only when mapped)
+    unsigned short *data16;    // Ptr to the raw data itself (read-only when mapped)
+    unsigned char *data_buf; // The reader's own buffer for the raw data
+    size_t data_bufsize;    // Bytes mapped at data_buf (0 = none)
+    void *decoded;          // Calibrated samples when decoding (psrfits_decode_subint)
+    size_t decoded_size;    // Bytes allocated at decoded
+    float *decode_gain;     // Per chan * pol gain, then offset, of the current row
+    size_t decode_nvals;    // Floats allocated at decode_gain
+    unsigned char *unpacked; // 1-, 2- and 4-bit DATA as one byte per sample
+    size_t unpacked_size;   // Bytes allocated at unpacked
+    size_t data_bytes;      // Bytes at data8/data16 (more than bytes_per_subint if unpacked)
 };
 
+// Number of scalar (one value per row) columns at the start of a SUBINT row
+#define PSRFITS_NSCALAR 12
+
+// SUBINT column numbers, looked up by name when a file is opened.
+// A missing optional column has number 0 and reads as 0.
+struct subint_cols {
+    int scalar[PSRFITS_NSCALAR];     // TSUBINT, OFFS_SUB, ..., TEL_ZEN
+    int scalar_type[PSRFITS_NSCALAR];  // TFLOAT or TDOUBLE as stored
+    long scalar_byte[PSRFITS_NSCALAR]; // Byte offset of the value in a row
+    long first_byte;        // Byte span of the scalar columns in a row,
+    long nbytes;            // read in one go (0 = read column by column)
+    long data_byte;         // Byte offset of DATA in a row (-1: unknown)
+    int dat_freq;
+    int dat_wts;
+    int dat_offs;
+    int dat_scl;
+    int data;
+};
+
+struct psrfits_prefetch;
+struct psrfits_throttle;
+
 struct psrfits {
     char basefilename[1024]; // The base filename from which to build the true filename
     char filename[1024];     // Filename of the current PSRFITs file
@@ -92,10 +127,40 @@ struct psrfits {
     int rows_per_file;      // The maximum number of rows (subints) per file
     int status;             // The CFITSIO status value
     fitsfile *fptr;         // The CFITSIO file structure
+    struct subint_cols cols; // SUBINT column numbers of the open file
+    unsigned char *map;     // The open file mapped read-only (NULL: read via CFITSIO)
+    size_t map_len;         // Bytes mapped at map
+    long long map_row1;     // Offset in map of the DATA of row 1
+    long long map_rowlen;   // Bytes from one row to the next
+    int map_charged;        // Row of the mapped file already charged to the read throttle
+    struct psrfits_prefetch *prefetch; // The reader thread, if started
+    int decode;             // PSRFITS_DECODE_* output in sub.decoded, or 0 for raw only
+    float requant_gain;     // 8-bit decode: out = decoded * gain + offset
+    float requant_offset;
+    int follow;             // Seconds to wait for a file set still being written to grow (0: don't)
+    int *follow_wake;       // Read end of a pipe that, once written to, makes psrfits_follow give up (NULL: none)
+    int quiet;              // psrfits_open says nothing about the file
+    struct psrfits_throttle *throttle; // Bandwidth limits, if any (shared)
+    pthread_mutex_t *cfitsio_lock; // Held around CFITSIO calls, if several readers share the process
+    struct psrfits_prefetch *map_owner; // Unmaps the file mappings instead (slots may still use them)
     struct hdrinfo hdr;
     struct subint sub;
 };
 
+// In decode_psrfits.c
+#define PSRFITS_DECODE_FLOAT 1
+#define PSRFITS_DECODE_8BIT 2
+int psrfits_unpack_subint(struct psrfits *pf);
+int psrfits_decode_subint(struct psrfits *pf);
+void psrfits_free_decoded(struct subint *sub);
+void psrfits_requant8(unsigned char *out, const float *in, size_t n,
+                      float gain, float offset);
+
+// In psrfits_subint.c
+int psrfits_alloc_subint(struct subint *sub, int nchan, int npol);
+void psrfits_free_subint(struct subint *sub);
+int psrfits_copy_subint(struct subint *dst, const struct subint *src);
+
 // In write_psrfits.c
 int psrfits_create(struct psrfits *pf);
 int psrfits_write_subint(struct psrfits *pf);
@@ -108,5 +173,27 @@ int psrfits_obs_mode(const char *obs_mode);
 // In read_psrfits.c
 int psrfits_open(struct psrfits *pf);
 int psrfits_read_subint(struct psrfits *pf);
+void psrfits_free_data(struct psrfits *pf);
+int psrfits_seek_sample(struct psrfits *pf, long long sample);
+int psrfits_seek_time(struct psrfits *pf, double t);
+void psrfits_unmap(struct psrfits *pf);
+
+// In follow_psrfits.c
+int psrfits_follow(struct psrfits *pf);
+
+// In throttle_psrfits.c
+#define PSRFITS_THROTTLE_READ 0
+#define PSRFITS_THROTTLE_WRITE 1
+int psrfits_throttle_start(struct psrfits *pf, double read_mbs, double write_mbs,
+                           const char *disk, double max_latency);
+void psrfits_throttle(struct psrfits *pf, int dir, size_t bytes);
+void psrfits_throttle_stop(struct psrfits *pf);
+
+// In prefetch_psrfits.c
+#define PSRFITS_PREFETCH_SLOTS 8
+int psrfits_prefetch_start(struct psrfits *pf, int nslots);
+int psrfits_prefetch_read(struct psrfits *pf);
+void psrfits_prefetch_unmap(struct psrfits_prefetch *p, unsigned char *map, size_t len);
+void psrfits_prefetch_stop(struct psrfits *pf);
 
 #endif
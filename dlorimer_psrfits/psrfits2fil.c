@@ -1,44 +1,395 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 #include "psrfits.h"
-#include "header.h"
+#include "filhdr.h"
 
 /*
  * This version of psrfits2fil is specifically for 20 converting
  * full stokes 20 m data on Cyborg
  */
-void send_coords(double raj, double dej, double az, double za) ;
-void send_double (char *name, double double_precision) ;
-void send_float(char *name,float floating_point) ;
-void send_int(char *name, int integer) ;
-void send_long(char *name, long integer) ;
-void send_string(char *string) ;
-FILE *input, *output;
-int swapout;
+static FILE *output;  /* the .fil */
+
+/* What to take from each subint */
+struct conv {
+  int startchan, endchan; /* 1-offset, inclusive */
+  int flip;
+  int nbits;              /* of the raw samples handed out by the reader */
+  int nprod, prod[4];     /* polarization products summed (-p, or just 0 when
+			     decimating), or 0 for the first of every 4
+			     spectra as before */
+  int tdec, fdec;         /* samples and channels summed into one (-t, -f) */
+  int requant;            /* summed output: 8 bits, mean*gain+offset */
+  float gain, offset;
+};
+
+/* Most bytes convert_subint can produce for one subint */
+static size_t conv_bytes_max(const struct psrfits *pf) {
+  size_t n=(size_t)pf->hdr.nsblk*pf->hdr.nchan*sizeof(float);
+  return (pf->sub.data_bytes>n) ? pf->sub.data_bytes : n;
+}
+
+/* Copy n elements of size bytes (1, 2 or 4) from in to out in reverse
+ * order, 16 bytes at a time with a byte shuffle.
+ */
+typedef unsigned char v16u8 __attribute__((vector_size(16)));
+
+static void copy_reversed(unsigned char *out, const unsigned char *in, int n, int size) {
+  static const v16u8 rev[5]={
+    {0}, {15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0},
+    {14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1}, {0},
+    {12,13,14,15,8,9,10,11,4,5,6,7,0,1,2,3}};
+  int per=16/size, i=0, b;
+  v16u8 x;
+  for (; i+per<=n; i+=per) {
+    /* elements n-i-per .. n-i-1 of in become i .. i+per-1 of out */
+    memcpy(&x,in+(size_t)(n-i-per)*size,16);
+    x=__builtin_shuffle(x,rev[size]);
+    memcpy(out+(size_t)i*size,&x,16);
+  }
+  for (; i<n; i++)
+    for (b=0;b<size;b++) out[(size_t)i*size+b]=in[(size_t)(n-1-i)*size+b];
+}
+
+/* -p, -t, -f: the products cv->prod of cv->tdec spectra at a time summed
+ * over the channel window, 4 floats at a time, then cv->fdec adjacent
+ * channels of that, written as float or as the mean requantised to 8
+ * bits.  Raw samples are 8-bit (or unpacked to 8 bits); calibrated ones
+ * come decoded as float.
+ */
+typedef float v4f __attribute__((vector_size(16)));
+typedef unsigned char v4u8 __attribute__((vector_size(4)));
+
+static size_t convert_summed(const struct psrfits *pf, const struct conv *cv,
+			     int first, int nwin, unsigned char *out) {
+  int npol=pf->hdr.npol, nout=nwin/cv->fdec, t, s, p, c, k;
+  size_t nchan=pf->hdr.nchan, n=0;
+  float acc[nwin];
+  unsigned char q[nout];
+
+  for (t=0;t+cv->tdec<=pf->hdr.nsblk;t+=cv->tdec) {
+    memset(acc,0,sizeof(acc));
+    for (s=t;s<t+cv->tdec;s++)
+      for (p=0;p<cv->nprod;p++) {
+	size_t off=((size_t)s*npol+cv->prod[p])*nchan+first;
+	v4f a,x;
+	if (pf->decode) {
+	  const float *in=(const float *)pf->sub.decoded+off;
+	  for (c=0;c+4<=nwin;c+=4) {
+	    memcpy(&a,acc+c,sizeof(a));
+	    memcpy(&x,in+c,sizeof(x));
+	    a+=x;
+	    memcpy(acc+c,&a,sizeof(a));
+	  }
+	  for (;c<nwin;c++) acc[c]+=in[c];
+	} else {
+	  const unsigned char *in=pf->sub.data8+off;
+	  v4u8 b;
+	  for (c=0;c+4<=nwin;c+=4) {
+	    memcpy(&a,acc+c,sizeof(a));
+	    memcpy(&b,in+c,sizeof(b));
+	    a+=__builtin_convertvector(b,v4f);
+	    memcpy(acc+c,&a,sizeof(a));
+	  }
+	  for (;c<nwin;c++) acc[c]+=in[c];
+	}
+      }
+    /* in place: channel c only overwrites sums already read */
+    if (cv->fdec>1)
+      for (c=0;c<nout;c++) {
+	float x=0.0f;
+	for (k=0;k<cv->fdec;k++) x+=acc[c*cv->fdec+k];
+	acc[c]=x;
+      }
+    if (cv->requant) {
+      /* the mean, so the levels match a single sample and can't wrap */
+      psrfits_requant8(q,acc,nout,cv->gain/(cv->nprod*cv->tdec*cv->fdec),cv->offset);
+      if (cv->flip) copy_reversed(out+n,q,nout,1);
+      else memcpy(out+n,q,nout);
+      n+=nout;
+    } else {
+      if (cv->flip) copy_reversed(out+n,(unsigned char *)acc,nout,sizeof(float));
+      else memcpy(out+n,acc,nout*sizeof(float));
+      n+=nout*sizeof(float);
+    }
+  }
+  return n;
+}
+
+/* The filterbank samples of the current subint, into out; returns the
+ * number of bytes.  Decoded data: the calibrated first polarization of
+ * each spectrum.  Raw data: the first of every 4 spectrum-sized blocks
+ * (the first polarization of full-Stokes Cyborg data), as always.  Each
+ * spectrum is one block copy (or reversed copy) of the channel window.
+ * Summing products or decimating: convert_summed.
+ */
+static size_t convert_subint(const struct psrfits *pf, const struct conv *cv,
+			     unsigned char *out) {
+  int nchan=pf->hdr.nchan, first=cv->startchan-1, last=cv->endchan;
+  int size, step, nspec, t;
+  size_t nivals=(size_t)nchan*pf->hdr.npol, n=0, spec_bytes, row_bytes;
+  const unsigned char *in;
+
+  if (first<0) first=0;
+  if (last>nchan) last=nchan;
+  if (last<=first) return 0;
+  if (cv->nprod) return convert_summed(pf,cv,first,last-first,out);
+
+  if (pf->decode) {
+    in=(const unsigned char *)pf->sub.decoded;
+    size=(pf->decode==PSRFITS_DECODE_FLOAT) ? sizeof(float) : 1;
+    row_bytes=nivals*size;   /* one spectrum, all polarizations */
+    nspec=pf->hdr.nsblk;
+    step=1;
+  } else {
+    in=(cv->nbits==8) ? pf->sub.data8 : (const unsigned char *)pf->sub.data16;
+    size=cv->nbits/8;
+    row_bytes=(size_t)nchan*size;
+    nspec=pf->sub.data_bytes/row_bytes;
+    step=4;
+  }
+  spec_bytes=(size_t)(last-first)*size;
+  for (t=0;t<nspec;t+=step) {
+    const unsigned char *win=in+t*row_bytes+(size_t)first*size;
+    if (cv->flip) copy_reversed(out+n,win,last-first,size);
+    else memcpy(out+n,win,spec_bytes);
+    n+=spec_bytes;
+  }
+  return n;
+}
+
+/* -p products: "I" for total intensity (AA+BB, or I of IQUV data), else
+ * product numbers (0-offset, in the order of POL_TYPE) joined by '+',
+ * e.g. "0+1".  Fills cv->prod; -1 if they aren't in the data.
+ */
+static int parse_products(const char *spec, const struct hdrinfo *hdr, struct conv *cv) {
+  char *end;
+  long p;
+
+  cv->nprod=0;
+  if (strcmp(spec,"I")==0) {
+    cv->prod[cv->nprod++]=0;
+    if (hdr->npol>1 && strncmp(hdr->poln_order,"IQUV",4)!=0) cv->prod[cv->nprod++]=1;
+    return 0;
+  }
+  for (;;) {
+    p=strtol(spec,&end,10);
+    if (end==spec || p<0 || p>=hdr->npol || cv->nprod==4) return -1;
+    cv->prod[cv->nprod++]=p;
+    if (*end=='\0') return 0;
+    if (*end!='+') return -1;
+    spec=end+1;
+  }
+}
+
+/* -jN: the files of the set are converted on N threads, each row
+ * straight to its place in the output with pwrite.  Every row of the set
+ * must come out the same size, which is checked.
+ */
+struct par_job {
+  const struct psrfits *pf; /* the first file: names and decode settings */
+  const struct conv *cv;
+  int nfiles;
+  long long *row0;          /* first row of each file in the output (rows before) */
+  int *rows;
+  size_t row_bytes;
+  off_t header_len;
+  int fd;
+  int next;                 /* next file to hand out */
+  int status;
+  pthread_mutex_t lock;
+};
+
+/* The bundled CFITSIO (3.006) has no reentrant build: its file table and
+ * I/O buffer cache are global, so every CFITSIO call (opening, closing and
+ * each row's scalars and DAT_ arrays, via w.cfitsio_lock) goes through
+ * this lock.  Only mapped DATA, decoding and convert_subint run in
+ * parallel: -j pays off on files psrfits_map can map, and reads the rest
+ * (scaled or tile-compressed DATA, gzip'ed files, PSRFITS_NOMMAP) one
+ * thread at a time.
+ */
+static pthread_mutex_t fits_lock=PTHREAD_MUTEX_INITIALIZER;
+
+static void *par_worker(void *arg) {
+  struct par_job *job=(struct par_job *)arg;
+  unsigned char *out=NULL;
+  int f,r,st;
+  size_t n;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    f=(job->status==0) ? job->next++ : job->nfiles;
+    pthread_mutex_unlock(&job->lock);
+    if (f>=job->nfiles) break;
+
+    struct psrfits w;
+    memset(&w,0,sizeof(w));
+    strcpy(w.basefilename,job->pf->basefilename);
+    w.filenum=job->pf->filenum+f;
+    w.decode=job->pf->decode;
+    w.requant_gain=job->pf->requant_gain;
+    w.requant_offset=job->pf->requant_offset;
+    w.throttle=job->pf->throttle;
+    w.cfitsio_lock=&fits_lock;
+    pthread_mutex_lock(&fits_lock);
+    st=psrfits_open(&w);
+    pthread_mutex_unlock(&fits_lock);
+    for (r=0;st==0 && r<job->rows[f];r++) {
+      if ((st=psrfits_read_subint(&w))!=0) break;
+      if (!out) out=(unsigned char *)malloc(conv_bytes_max(&w));
+      n=convert_subint(&w,job->cv,out);
+      psrfits_throttle(&w,PSRFITS_THROTTLE_WRITE,n);
+      if (n!=job->row_bytes ||
+	  pwrite(job->fd,out,n,job->header_len+(job->row0[f]+r)*(off_t)job->row_bytes)!=(ssize_t)n) {
+	fprintf(stderr,"error writing row %d of %s\n",r+1,w.filename);
+	st=-1;
+      }
+    }
+    pthread_mutex_lock(&fits_lock);
+    if (w.fptr) fits_close_file(w.fptr,&w.status);
+    pthread_mutex_unlock(&fits_lock);
+    psrfits_free_data(&w);
+    if (st) {
+      pthread_mutex_lock(&job->lock);
+      job->status=st;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+  free(out);
+  return NULL;
+}
+
+/* Convert the whole set that pf (first row just read) starts, on nthreads
+ * threads, after the header already written to output.
+ */
+static int convert_parallel(struct psrfits *pf, const struct conv *cv, int nthreads) {
+  struct par_job job;
+  pthread_t threads[nthreads];
+  unsigned char *out;
+  char name[1024];
+  fitsfile *fptr;
+  int t,rows,st;
+
+  memset(&job,0,sizeof(job));
+  job.pf=pf;
+  job.cv=cv;
+  out=(unsigned char *)malloc(conv_bytes_max(pf));
+  job.row_bytes=convert_subint(pf,cv,out);
+  free(out);
+
+  /* rows of every file of the set, for where each one goes */
+  for (;;) {
+    if (snprintf(name,sizeof(name),"%s_%04d.fits",pf->basefilename,
+		 pf->filenum+job.nfiles)>=(int)sizeof(name)) {
+      fprintf(stderr,"file name too long: %s_%04d.fits\n",pf->basefilename,
+	      pf->filenum+job.nfiles);
+      free(job.row0);
+      free(job.rows);
+      return FILE_NOT_OPENED;
+    }
+    st=0;
+    fits_open_file(&fptr,name,READONLY,&st);
+    if (st) break;
+    fits_movnam_hdu(fptr,BINARY_TBL,"SUBINT",0,&st);
+    fits_read_key(fptr,TINT,"NAXIS2",&rows,NULL,&st);
+    fits_close_file(fptr,&st);
+    if (st) break;
+    job.row0=(long long *)realloc(job.row0,(job.nfiles+1)*sizeof(long long));
+    job.rows=(int *)realloc(job.rows,(job.nfiles+1)*sizeof(int));
+    job.row0[job.nfiles]=job.nfiles ? job.row0[job.nfiles-1]+job.rows[job.nfiles-1] : 0;
+    job.rows[job.nfiles]=rows;
+    job.nfiles++;
+  }
+  fprintf(stderr,"Converting %d files on %d threads\n",job.nfiles,nthreads);
+  if (!pf->map)
+    fprintf(stderr,"Warning: %s can't be mapped: the threads take turns reading DATA\n",
+	    pf->filename);
+
+  fflush(output);
+  job.fd=fileno(output);
+  job.header_len=ftello(output);
+  pthread_mutex_init(&job.lock,NULL);
+  if (pf->fptr) fits_close_file(pf->fptr,&st);
+  pf->fptr=NULL;
+  psrfits_free_data(pf);
+
+  for (t=0;t<nthreads;t++) pthread_create(&threads[t],NULL,par_worker,&job);
+  for (t=0;t<nthreads;t++) pthread_join(threads[t],NULL);
+  pthread_mutex_destroy(&job.lock);
+  free(job.row0);
+  free(job.rows);
+  return job.status;
+}
 
 main (int argc, char **argv){
-  unsigned char *data8;
-  unsigned short *data16;
-  int flip=0,i,j,k,l,x,status,first=1,startchan,endchan,idump=0,ndumps=1;
-  int counter,bandpass=0,npersub;
+  unsigned char *out;
+  size_t n;
+  struct conv cv;
+  int flip=0,status,first=1,startchan,endchan;
+  int counter,bandpass=0,nthreads=1;
+  int tdec=1,fdec=1;
+  double read_mbs=0.0,write_mbs=0.0,max_latency=20.0;
+  char *disk=NULL;
+  char *products=NULL;
+  int (*read_subint)(struct psrfits *);
   struct psrfits pf;
   double toff,fcent,tsamp,chbw;
-  double rah,ram,ras,ded,dem,des,sgn;
+  double rah,ram,ras,ded,dem,des,sgn,raj,dej;
+  struct filhdr fh;
   char filfile[1024],stem[1024], *pos;
 
+  memset(&pf, 0, sizeof(pf)); /* no data buffer yet, terminated names */
+  memset(&cv, 0, sizeof(cv));
   startchan=endchan=0;
 //  startchan=695;
 //  endchan=950;
 
+  /* -jN: convert the files of the set on N threads
+     -pI, -p0+1, ...: sum those polarization products
+     -tN, -fN: add up N samples, N channels into one
+     -F(N): follow a set still being recorded, until N s (600) without
+            a new subint
+     -bR(:W): read at most R, write at most W (R) MB/s
+     -Bdisk(:ms): slow down while writes to disk (as in /proc/diskstats)
+            take longer than ms (20); needs -b */
+  while (argc>1 && argv[1][0]=='-') {
+    if (strncmp(argv[1],"-j",2)==0) {
+      nthreads=atoi(argv[1]+2);
+      if (nthreads<1) nthreads=1;
+    } else if (strncmp(argv[1],"-p",2)==0) {
+      products=argv[1]+2;
+    } else if (strncmp(argv[1],"-t",2)==0) {
+      tdec=atoi(argv[1]+2);
+    } else if (strncmp(argv[1],"-f",2)==0) {
+      fdec=atoi(argv[1]+2);
+    } else if (strncmp(argv[1],"-F",2)==0) {
+      pf.follow=(argv[1][2]) ? atoi(argv[1]+2) : 600;
+    } else if (strncmp(argv[1],"-b",2)==0) {
+      read_mbs=write_mbs=atof(argv[1]+2);
+      if ((pos=strchr(argv[1],':'))) write_mbs=atof(pos+1);
+    } else if (strncmp(argv[1],"-B",2)==0) {
+      disk=argv[1]+2;
+      if ((pos=strchr(disk,':'))) {
+	*pos='\0';
+	max_latency=atof(pos+1);
+      }
+    } else break;
+    argv++;
+    argc--;
+  }
+
   if (argc < 2) {
-    printf("usage: psrfits2fil fitsfile (startchan) (endchan) (flip) (fcentMHz) (tsampus)\n");
+    printf("usage: psrfits2fil (-jN) (-pI|-p0+1...) (-tN) (-fN) (-F(N)) (-bR(:W)) (-Bdisk(:ms)) fitsfile (startchan) (endchan) (flip) (fcentMHz) (tsampus) (float|8bit (gain) (offset))\n");
     exit(0);
   }
 
   if (argc>2) {
-    if (strstr(argv[2],"bandpass")!=NULL)  bandpass=1;
+    if (strstr(argv[2],"bandpass")!=NULL)  bandpass=nthreads=1;
     startchan=atoi(argv[2]);
   }
 
@@ -60,6 +411,51 @@ main (int argc, char **argv){
     tsamp=1.0e-6*atof(argv[6]);
   }
 
+  /* apply DAT_SCL/DAT_OFFS/DAT_WTS: 32-bit float output, or requantised
+     8-bit output = calibrated*gain+offset */
+  if (argc>7) {
+    if (strstr(argv[7],"float")!=NULL) pf.decode=PSRFITS_DECODE_FLOAT;
+    if (strstr(argv[7],"8bit")!=NULL) pf.decode=PSRFITS_DECODE_8BIT;
+    pf.requant_gain=(argc>8) ? atof(argv[8]) : 1.0;
+    pf.requant_offset=(argc>9) ? atof(argv[9]) : 0.0;
+  }
+
+  /* following, the subints come one at a time: no point in -j, and
+     the recorder's disk gets the lowest I/O priority (ionice -c 3) */
+  if (pf.follow) {
+    nthreads=1;
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set,1 /* IOPRIO_WHO_PROCESS */,0,3<<13 /* IOPRIO_CLASS_IDLE */);
+#endif
+  }
+
+  /* -B only scales the -b rates down: on its own it would do nothing */
+  if (disk && read_mbs<=0.0 && write_mbs<=0.0) {
+    fprintf(stderr,"-B%s needs a bandwidth limit (-b) to slow down\n",disk);
+    exit(0);
+  }
+  if ((read_mbs>0.0 || write_mbs>0.0) &&
+      psrfits_throttle_start(&pf,read_mbs,write_mbs,disk,max_latency)!=0) {
+    fprintf(stderr,"error setting up the bandwidth limits\n");
+    exit(0);
+  }
+
+  if (tdec<1 || fdec<1) {
+    puts("Decimation factors must be 1 or more");
+    exit(0);
+  }
+  cv.tdec=tdec;
+  cv.fdec=fdec;
+
+  /* summed samples are requantised here, after the sum, so decode
+     them as float; raw ones come out as 8 bits too */
+  if (products || tdec>1 || fdec>1) {
+    cv.requant=(pf.decode!=PSRFITS_DECODE_FLOAT);
+    cv.gain=(pf.decode==PSRFITS_DECODE_8BIT) ? pf.requant_gain : 1.0;
+    cv.offset=(pf.decode==PSRFITS_DECODE_8BIT) ? pf.requant_offset : 0.0;
+    if (pf.decode==PSRFITS_DECODE_8BIT) pf.decode=PSRFITS_DECODE_FLOAT;
+  }
+
   if ( (pos = strstr(argv[1],".fits")) ) {
     strncpy(pf.basefilename,argv[1],strlen(argv[1])-10);
     strcpy(pf.filename,argv[1]);
@@ -83,8 +479,19 @@ main (int argc, char **argv){
     exit(0);
   }
 
+  /* read (and open the next files) in the background; with -jN only
+     the first row is read here, for the header */
+  read_subint=psrfits_read_subint;
+  if (nthreads==1) {
+    if (psrfits_prefetch_start(&pf, PSRFITS_PREFETCH_SLOTS) != 0) {
+      fprintf(stderr,"error starting the reader thread\n");
+      exit(0);
+    }
+    read_subint=psrfits_prefetch_read;
+  }
+
   counter=0;
-  while ( psrfits_read_subint(&pf)== 0) {
+  while ( read_subint(&pf)== 0) {
     if (first) {
       if (fcent == 0.0) fcent=pf.hdr.fctr;
 	fprintf(stderr,"Center frequency %f MHz\n",fcent);
@@ -93,34 +500,53 @@ main (int argc, char **argv){
 	//flip=0;
   if (flip==0) printf("No flipping of the channels!\n");
   if (flip==1) printf("Flipping channels!\n");
-      /* broadcast header file */
-      send_string("HEADER_START");
-      send_string("rawdatafile");
-      send_string(filbasename);
-      send_string("source_name");
-      send_string(pf.hdr.source);
-      send_int("data_type",1);
       if (startchan==0) startchan=1;
       if (endchan==0) endchan=pf.hdr.nchan;
-      send_int("nchans",endchan-startchan+1);
-	fprintf(stderr,"Output number of channels %d\n",endchan-startchan+1);
-      send_double("fch1",fcent+fabs(pf.hdr.BW)/2.+chbw/2.+(startchan-1)*chbw);
-      send_double("foff",-1.0*fabs(chbw));
-      send_int("nbits",pf.hdr.nbits);
-      send_int("nbeams",1);
-      send_int("ibeam",1);
-      send_int("nifs",1);
+      if (products && parse_products(products,&pf.hdr,&cv)!=0) {
+	printf("No products %s in %d-polarization data\n",products,pf.hdr.npol);
+	exit(0);
+      }
+      if (!products && (tdec>1 || fdec>1)) cv.prod[cv.nprod++]=0;
+      if (cv.nprod && !pf.decode && pf.hdr.nbits>8) {
+	puts("Summing 16 bit samples needs float or 8bit output");
+	exit(0);
+      }
+      if (pf.hdr.nsblk%tdec || (endchan-startchan+1)%fdec) {
+	printf("%d samples per subint and %d channels must divide by -t%d, -f%d\n",
+	       pf.hdr.nsblk,endchan-startchan+1,tdec,fdec);
+	exit(0);
+      }
+      /* broadcast header file */
+      filhdr_init(&fh,0);
+      filhdr_string(&fh,"HEADER_START");
+      filhdr_string(&fh,"rawdatafile");
+      filhdr_string(&fh,filbasename);
+      filhdr_string(&fh,"source_name");
+      filhdr_string(&fh,pf.hdr.source);
+      filhdr_int(&fh,"data_type",1);
+      filhdr_int(&fh,"nchans",(endchan-startchan+1)/fdec);
+	fprintf(stderr,"Output number of channels %d\n",(endchan-startchan+1)/fdec);
+      /* the middle of the first fdec channels */
+      filhdr_double(&fh,"fch1",fcent+fabs(pf.hdr.BW)/2.+chbw/2.+(startchan-1)*chbw-(fdec-1)*fabs(chbw)/2.);
+      filhdr_double(&fh,"foff",-1.0*fabs(chbw)*fdec);
+      if (cv.requant) filhdr_int(&fh,"nbits",8);
+      else if (pf.decode==PSRFITS_DECODE_FLOAT) filhdr_int(&fh,"nbits",32);
+      else if (pf.decode==PSRFITS_DECODE_8BIT) filhdr_int(&fh,"nbits",8);
+      else filhdr_int(&fh,"nbits",pf.hdr.nbits<8 ? 8 : pf.hdr.nbits);
+      filhdr_int(&fh,"nbeams",1);
+      filhdr_int(&fh,"ibeam",1);
+      filhdr_int(&fh,"nifs",1);
       if (tsamp == 0.0) tsamp=pf.hdr.dt; 
-	fprintf(stderr,"Sampling time %f us\n",tsamp*1.0e6);
-      send_double("tsamp",tsamp);
-      send_double("tstart",pf.hdr.MJD_epoch);
-      send_int("telescope_id",32); /* this is going to be the 20 m code */
-      send_int("machine_id",32); /* this is going to be Cyborg on 20 m */
+	fprintf(stderr,"Sampling time %f us\n",tsamp*tdec*1.0e6);
+      filhdr_double(&fh,"tsamp",tsamp*tdec);
+      filhdr_double(&fh,"tstart",pf.hdr.MJD_epoch);
+      filhdr_int(&fh,"telescope_id",32); /* this is going to be the 20 m code */
+      filhdr_int(&fh,"machine_id",32); /* this is going to be Cyborg on 20 m */
 
       rah=atof(strtok(pf.hdr.ra_str,":"));
       ram=atof(strtok(NULL,":"));
       ras=atof(strtok(NULL,":"));
-      src_raj=rah*10000.0+ram*100.0+ras;
+      raj=rah*10000.0+ram*100.0+ras;
       ded=atof(strtok(pf.hdr.dec_str,":"));
       dem=atof(strtok(NULL,":"));
       des=atof(strtok(NULL,":"));
@@ -128,63 +554,37 @@ main (int argc, char **argv){
 	sgn=-1.0;
       else
 	sgn=1.0;
-      src_dej=fabs(ded)*10000.0+sgn*dem*100.0+sgn*des;
-      az_start=pf.sub.tel_az;
-      za_start=pf.sub.tel_zen;
-      send_coords(src_raj,src_dej,az_start,za_start);
-      send_string("HEADER_END");
-      first=0;
-      if (pf.hdr.nbits==8) {
-	data8=(unsigned char *)malloc(ndumps*sizeof(char)*pf.hdr.nchan);
-	npersub=pf.sub.bytes_per_subint;
-      } else if (pf.hdr.nbits==16) {
-	data16=(unsigned short *)malloc(ndumps*sizeof(short)*pf.hdr.nchan);
-	npersub=pf.sub.bytes_per_subint/2;
-      } else {
-	puts("psrfits2fil currently only works with 8 or 16 bit data");
+      dej=fabs(ded)*10000.0+sgn*dem*100.0+sgn*des;
+      filhdr_coords(&fh,raj,dej,pf.sub.tel_az,pf.sub.tel_zen);
+      filhdr_string(&fh,"HEADER_END");
+      if (filhdr_write(&fh,output)!=0) {
+	fprintf(stderr,"error writing the header of %s\n",filfile);
 	exit(0);
       }
-    }
-    i=j=k=l=0;
-    while (i<npersub) {
-//	printf("%d %d\n",i,pf.sub.bytes_per_subint);
-      if (j==0) {
-	k++;
-	if ((k>=startchan) && (k<=endchan)) {
-	  if (pf.hdr.nbits==8) data8[l++]=pf.sub.data8[i];
-	  if (pf.hdr.nbits==16) data16[l++]=pf.sub.data16[i];
-	}
-	if (k==pf.hdr.nchan) {
-	  idump++;
-	  if (idump==ndumps) {
-	    if (flip) {
-	      for (x=l-1;x>=0;x--)
-		if (pf.hdr.nbits==8) {
-		  fwrite(&data8[x],sizeof(char),1,output);
-		} else {
-		  fwrite(&data16[x],sizeof(short),1,output);
-		}
-	    } else {
-	      if (pf.hdr.nbits==8) {
-		fwrite(data8,sizeof(char),l,output);
-	      } else {
-		fwrite(data16,sizeof(short),l,output);
-	      }
-	    }
-	    idump=l=0;
-	  }
-	  k=0;
-	}
+      filhdr_free(&fh);
+      first=0;
+      /* 1, 2 and 4 bit data comes unpacked to a byte per sample */
+      cv.nbits=(pf.hdr.nbits<8) ? 8 : pf.hdr.nbits;
+      if (cv.nbits!=8 && cv.nbits!=16) {
+	puts("psrfits2fil currently only works with 1, 2, 4, 8 or 16 bit data");
+	exit(0);
       }
-      i++;
-      if (i%pf.hdr.nchan==0) j++;
-      if (j==4) j=0;
+      cv.startchan=startchan;
+      cv.endchan=endchan;
+      cv.flip=flip;
+      out=(unsigned char *)malloc(conv_bytes_max(&pf));
+      if (nthreads>1) break;
     }
-    if (pf.hdr.nbits==8) free(pf.sub.data8);
-    if (pf.hdr.nbits==16) free(pf.sub.data16);
-    if ((idump>0)&&(pf.hdr.nbits==8))  fwrite(data8,sizeof(char),l,output);
-    if ((idump>0)&&(pf.hdr.nbits==16)) fwrite(data16,sizeof(short),l,output);
-    idump=0;
+    n=convert_subint(&pf,&cv,out);
+    psrfits_throttle(&pf,PSRFITS_THROTTLE_WRITE,n);
+    fwrite(out,1,n,output);
+    if (pf.follow) fflush(output); /* for whoever reads the .fil meanwhile */
     if (bandpass)  exit(0);
   }
+  if (nthreads>1 && !first) {
+    if (convert_parallel(&pf,&cv,nthreads)!=0) fprintf(stderr,"conversion failed\n");
+  }
+  psrfits_prefetch_stop(&pf);
+  psrfits_free_data(&pf);
+  psrfits_throttle_stop(&pf);
 }
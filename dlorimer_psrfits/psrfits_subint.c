@@ -0,0 +1,75 @@
+/* psrfits_subint.c
+ * The per-channel arrays of struct subint, shared by the reader and
+ * the writer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "psrfits.h"
+
+/* Size the dat_ arrays of sub for nchan channels and npol polarizations:
+ * one block holding freqs[nchan], weights[nchan], offsets[nchan*npol]
+ * and scales[nchan*npol] back to back.  Nothing changes if the arrays
+ * already have that shape.  The arrays must be NULL (a zeroed struct)
+ * the first time.
+ */
+int psrfits_alloc_subint(struct subint *sub, int nchan, int npol) {
+
+    size_t nivals = (size_t)nchan * npol;
+    float *block;
+
+    if (sub->dat_freqs && sub->dat_nchan == nchan && sub->dat_npol == npol)
+        return 0;
+    psrfits_free_subint(sub);
+    if (nchan <= 0 || npol <= 0) { return 0; }
+    block = (float *)malloc(sizeof(float) * (2 * nchan + 2 * nivals));
+    if (!block) {
+        fprintf(stderr, "Error: can't allocate arrays for %d channels x %d pols\n",
+                nchan, npol);
+        return MEMORY_ALLOCATION;
+    }
+    sub->dat_freqs = block;
+    sub->dat_weights = block + nchan;
+    sub->dat_offsets = block + 2 * nchan;
+    sub->dat_scales = block + 2 * nchan + nivals;
+    sub->dat_nchan = nchan;
+    sub->dat_npol = npol;
+    return 0;
+}
+
+void psrfits_free_subint(struct subint *sub) {
+    free(sub->dat_freqs);
+    sub->dat_freqs = sub->dat_weights = NULL;
+    sub->dat_offsets = sub->dat_scales = NULL;
+    sub->dat_nchan = sub->dat_npol = 0;
+}
+
+/* Copy src into dst, the dat_ arrays into dst's own (resized) ones.  The
+ * data pointers are copied as they are; dst keeps its own unpacking,
+ * gain and decoded buffers.
+ */
+int psrfits_copy_subint(struct subint *dst, const struct subint *src) {
+
+    struct subint arrays = *dst;
+    int status;
+
+    status = psrfits_alloc_subint(&arrays, src->dat_nchan, src->dat_npol);
+    *dst = *src;
+    dst->dat_freqs = arrays.dat_freqs;
+    dst->dat_weights = arrays.dat_weights;
+    dst->dat_offsets = arrays.dat_offsets;
+    dst->dat_scales = arrays.dat_scales;
+    dst->dat_nchan = arrays.dat_nchan;
+    dst->dat_npol = arrays.dat_npol;
+    dst->unpacked = arrays.unpacked;
+    dst->unpacked_size = arrays.unpacked_size;
+    dst->decode_gain = arrays.decode_gain;
+    dst->decode_nvals = arrays.decode_nvals;
+    dst->decoded = arrays.decoded;
+    dst->decoded_size = arrays.decoded_size;
+    if (status) { return status; }
+    if (src->dat_freqs)
+        memcpy(dst->dat_freqs, src->dat_freqs,
+                sizeof(float) * 2 * (src->dat_nchan + (size_t)src->dat_nchan * src->dat_npol));
+    return 0;
+}
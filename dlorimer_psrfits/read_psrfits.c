@@ -2,9 +2,25 @@
  * Paul Demorest, 05/2008
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "psrfits.h"
 
+// Scalar SUBINT columns, in the order of the doubles at the top of
+// struct subint
+static const char *scalar_names[PSRFITS_NSCALAR] = {
+    "TSUBINT", "OFFS_SUB", "LST_SUB", "RA_SUB", "DEC_SUB", "GLON_SUB",
+    "GLAT_SUB", "FD_ANG", "POS_ANG", "PAR_ANG", "TEL_AZ", "TEL_ZEN"
+};
+
+// Largest byte span of the scalar columns read with one call
+#define PSRFITS_SCALAR_BYTES 1024
+
 // Define different obs modes
 static const int search=SEARCH_MODE, fold=FOLD_MODE;
 int psrfits_obs_mode(const char *obs_mode) {
@@ -21,6 +37,301 @@ int psrfits_obs_mode(const char *obs_mode) {
     return(search);
 }
 
+/* Byte offset in a row of each column of the current binary table, or
+ * NULL if that can't be worked out.  Binary tables have no TBCOLn: the
+ * offsets are the TFORMn widths summed, which must come to NAXIS1.
+ */
+static long *psrfits_col_offsets(fitsfile *fptr) {
+
+    char key[FLEN_KEYWORD], tform[FLEN_VALUE];
+    int i, ncols, code, status = 0;
+    long repeat, width, rowlen, *offs;
+
+    fits_get_num_cols(fptr, &ncols, &status);
+    fits_read_key(fptr, TLONG, "NAXIS1", &rowlen, NULL, &status);
+    if (status || ncols < 1) { return NULL; }
+    offs = (long *)malloc(sizeof(long) * (ncols + 1));
+    if (!offs) { return NULL; }
+    offs[0] = 0;
+    for (i = 1; i <= ncols && status == 0; i++) {
+        fits_make_keyn("TFORM", i, key, &status);
+        fits_read_key(fptr, TSTRING, key, tform, NULL, &status);
+        fits_binary_tform(tform, &code, &repeat, &width, &status);
+        if (code < 0)                   // P: a (count, offset) descriptor
+            offs[i] = offs[i - 1] + 8;
+        else if (code == TBIT)
+            offs[i] = offs[i - 1] + (repeat + 7) / 8;
+        else if (code == TSTRING)
+            offs[i] = offs[i - 1] + repeat;
+        else
+            offs[i] = offs[i - 1] + repeat * width;
+    }
+    if (status || offs[ncols] != rowlen) {
+        if (status) fits_clear_errmsg();
+        free(offs);
+        return NULL;
+    }
+    return offs;
+}
+
+// Whether column colnum is stored unscaled (TSCALn 1, TZEROn 0 or absent)
+static int psrfits_col_unscaled(fitsfile *fptr, int colnum) {
+    char key[FLEN_KEYWORD];
+    double scale = 1.0, zero = 0.0;
+    int status = 0;
+
+    fits_make_keyn("TSCAL", colnum, key, &status);
+    fits_read_key(fptr, TDOUBLE, key, &scale, NULL, &status);
+    if (status) { scale = 1.0; fits_clear_errmsg(); }
+    status = 0;
+    fits_make_keyn("TZERO", colnum, key, &status);
+    fits_read_key(fptr, TDOUBLE, key, &zero, NULL, &status);
+    if (status) { zero = 0.0; fits_clear_errmsg(); }
+    return scale == 1.0 && zero == 0.0;
+}
+
+/* Look up the SUBINT columns by name (the current HDU must be SUBINT).
+ * DAT_FREQ, DAT_WTS, DAT_OFFS, DAT_SCL and DATA are required; any of
+ * the scalar columns may be missing.  If all the scalars that are there
+ * are plain, unscaled E or D values, also note where they sit in a row
+ * so psrfits_read_subint can fetch them with a single read.
+ */
+static int psrfits_find_cols(struct psrfits *pf) {
+
+    struct subint_cols *cols = &(pf->cols);
+    int *status = &(pf->status);
+    int i, lookup, type;
+    long end = 0, repeat, width, *offs;
+
+    fits_get_colnum(pf->fptr, CASEINSEN, "DAT_FREQ", &(cols->dat_freq), status);
+    fits_get_colnum(pf->fptr, CASEINSEN, "DAT_WTS", &(cols->dat_wts), status);
+    fits_get_colnum(pf->fptr, CASEINSEN, "DAT_OFFS", &(cols->dat_offs), status);
+    fits_get_colnum(pf->fptr, CASEINSEN, "DAT_SCL", &(cols->dat_scl), status);
+    fits_get_colnum(pf->fptr, CASEINSEN, "DATA", &(cols->data), status);
+    if (*status) { return *status; }
+
+    // Without the row layout everything is read column by column
+    offs = psrfits_col_offsets(pf->fptr);
+    cols->data_byte = offs ? offs[cols->data - 1] : -1;
+    if (!offs) end = -1;
+
+    cols->first_byte = -1;
+    for (i = 0; i < PSRFITS_NSCALAR; i++) {
+        lookup = 0;
+        fits_get_colnum(pf->fptr, CASEINSEN, (char *)scalar_names[i],
+                &(cols->scalar[i]), &lookup);
+        if (lookup) {
+            // Not in this layout; it reads as 0, and the failed lookup
+            // mustn't show up in a later fits_report_error
+            cols->scalar[i] = 0;
+            fits_clear_errmsg();
+            continue;
+        }
+        fits_get_coltype(pf->fptr, cols->scalar[i], &type, &repeat, &width,
+                &lookup);
+        cols->scalar_type[i] = type;
+        cols->scalar_byte[i] = offs ? offs[cols->scalar[i] - 1] : 0;
+        if (lookup || repeat != 1 || (type != TFLOAT && type != TDOUBLE) ||
+            !psrfits_col_unscaled(pf->fptr, cols->scalar[i])) {
+            end = -1;
+        } else if (end >= 0) {
+            if (cols->first_byte < 0 || cols->scalar_byte[i] < cols->first_byte)
+                cols->first_byte = cols->scalar_byte[i];
+            if (cols->scalar_byte[i] + width > end)
+                end = cols->scalar_byte[i] + width;
+        }
+    }
+    free(offs);
+    cols->nbytes = 0;
+    if (end > 0 && end - cols->first_byte <= PSRFITS_SCALAR_BYTES)
+        cols->nbytes = end - cols->first_byte;
+    return *status;
+}
+
+// Big-endian E or D value at p
+static double scalar_value(const unsigned char *p, int type) {
+    int i;
+    if (type == TDOUBLE) {
+        uint64_t x = 0;
+        double d;
+        for (i = 0; i < 8; i++) x = (x << 8) | p[i];
+        memcpy(&d, &x, sizeof(d));
+        return d;
+    } else {
+        uint32_t x = 0;
+        float f;
+        for (i = 0; i < 4; i++) x = (x << 8) | p[i];
+        memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+}
+
+/* The raw data of a row is read into one buffer that lives as long as
+ * the psrfits struct (released by psrfits_free_data), mapped rather than
+ * malloc'ed so it is page aligned and, when big enough, eligible for
+ * transparent huge pages.  Set PSRFITS_HUGEPAGES in the environment to
+ * ask for explicit (hugetlbfs) pages first.  The buffer only changes when
+ * a file needs more than it holds.
+ */
+#define PSRFITS_HUGEPAGE_SIZE (2L << 20)
+
+static int psrfits_alloc_data(struct psrfits *pf) {
+
+    struct subint *sub = &(pf->sub);
+    size_t need = sub->bytes_per_subint;
+    void *buf = MAP_FAILED;
+
+    if (need <= sub->data_bufsize) { return 0; }
+    // Only the old buffer: the dat_ arrays are already sized for this file
+    if (sub->data_bufsize) munmap(sub->data_buf, sub->data_bufsize);
+    sub->data_buf = NULL;
+    sub->data_bufsize = 0;
+
+#ifdef MAP_HUGETLB
+    if (getenv("PSRFITS_HUGEPAGES")) {
+        size_t size = (need + PSRFITS_HUGEPAGE_SIZE - 1) & ~(PSRFITS_HUGEPAGE_SIZE - 1);
+        buf = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (buf != MAP_FAILED) need = size;
+    }
+#endif
+    if (buf == MAP_FAILED) {
+        long page = sysconf(_SC_PAGESIZE);
+        need = (need + page - 1) & ~(size_t)(page - 1);
+        buf = mmap(NULL, need, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) {
+            fprintf(stderr, "Error: can't allocate %d bytes for a subint\n",
+                    sub->bytes_per_subint);
+            return -1;
+        }
+#ifdef MADV_HUGEPAGE
+        if (need >= PSRFITS_HUGEPAGE_SIZE) madvise(buf, need, MADV_HUGEPAGE);
+#endif
+    }
+    sub->data_buf = (unsigned char *)buf;
+    sub->data_bufsize = need;
+    return 0;
+}
+
+/* For a plain, uncompressed file on disk the DATA of every row sits at a
+ * fixed place in the file, so rather than copy it through CFITSIO the
+ * whole file is mapped and data8/data16 point straight at each row
+ * (PSRFITS_NOMMAP in the environment turns this off).  Anything else --
+ * gzip'ed or tile-compressed files, scaled or heap-stored DATA, remote
+ * URLs -- is read with fits_read_col as before.
+ */
+void psrfits_unmap(struct psrfits *pf) {
+    if (pf->map && pf->map_owner)
+        psrfits_prefetch_unmap(pf->map_owner, pf->map, pf->map_len);
+    else if (pf->map)
+        munmap(pf->map, pf->map_len);
+    pf->map = NULL;
+    pf->map_len = 0;
+}
+
+static void psrfits_map(struct psrfits *pf) {
+
+    LONGLONG headstart, datastart, dataend;
+    char magic[6];
+    struct stat st;
+    int fd, status = 0;
+    long rowlen;
+
+    if (getenv("PSRFITS_NOMMAP")) { return; }
+
+    // Tile-compressed tables have ZTABLE = T
+    int ztable = 0;
+    fits_read_key(pf->fptr, TLOGICAL, "ZTABLE", &ztable, NULL, &status);
+    if (status == 0 && ztable) { return; }
+    if (status) fits_clear_errmsg();
+    status = 0;
+
+    // Raw bytes, in a fixed place in every row
+    int type;
+    long repeat, width;
+    fits_get_coltype(pf->fptr, pf->cols.data, &type, &repeat, &width, &status);
+    if (status || type < 0 || pf->cols.data_byte < 0 ||
+        repeat < pf->sub.bytes_per_subint ||
+        !psrfits_col_unscaled(pf->fptr, pf->cols.data)) { return; }
+    fits_get_hduaddrll(pf->fptr, &headstart, &datastart, &dataend, &status);
+    fits_read_key(pf->fptr, TLONG, "NAXIS1", &rowlen, NULL, &status);
+    if (status) { return; }
+
+    fd = open(pf->filename, O_RDONLY);
+    if (fd < 0) { return; }
+    // A gzip'ed file (which CFITSIO unpacks in memory) has no FITS header
+    // at the start
+    if (read(fd, magic, 6) != 6 || strncmp(magic, "SIMPLE", 6) != 0 ||
+        fstat(fd, &st) != 0 || (LONGLONG)st.st_size < dataend) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, datastart, dataend - datastart, POSIX_FADV_SEQUENTIAL);
+#endif
+    close(fd);  // the mapping keeps the file
+    if (map == MAP_FAILED) { return; }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    pf->map = (unsigned char *)map;
+    pf->map_len = st.st_size;
+    pf->map_row1 = datastart + pf->cols.data_byte;
+    pf->map_rowlen = rowlen;
+    pf->map_charged = 0;
+}
+
+// Read a byte of every page of p[0..len), so they are read in from disk
+static void psrfits_touch(const unsigned char *p, size_t len) {
+    size_t page = sysconf(_SC_PAGESIZE), i;
+    volatile unsigned char sink;
+    for (i = 0; i < len; i += page) sink = p[i];
+    if (len) sink = p[len - 1];
+    (void)sink;
+}
+
+/* A file still being written can count rows in NAXIS2 whose DATA isn't
+ * all on disk yet: leave those out of rows_per_file, and any row in a
+ * 2880-byte FITS block not yet written in full (CFITSIO reads whole
+ * blocks).  A mapped file counts only as far as it is mapped, however
+ * much it has grown since.
+ */
+static void psrfits_complete_rows(struct psrfits *pf) {
+
+    LONGLONG headstart, datastart, dataend;
+    struct stat st;
+    long rowlen;
+    int status = 0;
+
+    fits_get_hduaddrll(pf->fptr, &headstart, &datastart, &dataend, &status);
+    fits_read_key(pf->fptr, TLONG, "NAXIS1", &rowlen, NULL, &status);
+    if (status || rowlen <= 0) { return; }
+    if (pf->map) {
+        st.st_size = pf->map_len;
+    } else if (stat(pf->filename, &st) != 0) {
+        return;
+    }
+    long long rows = ((LONGLONG)st.st_size / 2880 * 2880 - datastart) / rowlen;
+    if (rows < 0) rows = 0;
+    if (rows < pf->rows_per_file) pf->rows_per_file = (int)rows;
+}
+
+/* Release the data buffer, file mapping and arrays of the reader.  The
+ * struct can be reopened afterwards.
+ */
+void psrfits_free_data(struct psrfits *pf) {
+    struct subint *sub = &(pf->sub);
+    psrfits_unmap(pf);
+    psrfits_free_subint(sub);
+    psrfits_free_decoded(sub);
+    if (sub->data_bufsize) munmap(sub->data_buf, sub->data_bufsize);
+    sub->data_buf = NULL;
+    sub->data8 = NULL;
+    sub->data16 = NULL;
+    sub->data_bufsize = 0;
+}
+
 /* This function is similar to psrfits_create, except it
  * deals with reading existing files.  It is assumed that
  * basename and filenum are filled in correctly to point to 
@@ -42,7 +353,7 @@ int psrfits_open(struct psrfits *pf) {
 
     // If file no exist, exit now
     if (*status) { return *status; }
-    fprintf(stderr,"Opened %s\n", pf->filename);
+    if (!pf->quiet) fprintf(stderr,"Opened %s\n", pf->filename);
 
     // Move to main HDU
     fits_movabs_hdu(pf->fptr, 1, NULL, status);
@@ -95,6 +406,8 @@ int psrfits_open(struct psrfits *pf) {
     // Read some more stuff
     fits_read_key(pf->fptr, TINT, "NPOL", &(hdr->npol), NULL, status);
     fits_read_key(pf->fptr, TSTRING, "POL_TYPE", ctmp, NULL, status);
+    snprintf(hdr->poln_order, sizeof(hdr->poln_order), "%.*s",
+             (int)sizeof(hdr->poln_order) - 1, ctmp);
     if (strncmp(ctmp, "AA+BB", 6)==0) hdr->summed_polns=1;
     else hdr->summed_polns=0;
     fits_read_key(pf->fptr, TDOUBLE, "TBIN", &(hdr->dt), NULL, status);
@@ -105,6 +418,19 @@ int psrfits_open(struct psrfits *pf) {
     fits_read_key(pf->fptr, TDOUBLE, "CHAN_BW", &(hdr->df), NULL, status);
     fits_read_key(pf->fptr, TINT, "NSBLK", &(hdr->nsblk), NULL, status);
     fits_read_key(pf->fptr, TINT, "NBITS", &(hdr->nbits), NULL, status);
+    if (*status == 0) {
+        // Optional
+        int zstatus = 0;
+        hdr->zero_off = 0.0;
+        fits_read_key(pf->fptr, TDOUBLE, "ZERO_OFF", &(hdr->zero_off), NULL,
+                &zstatus);
+        if (zstatus) hdr->zero_off = 0.0;
+    }
+
+    // Column numbers can differ from file to file
+    if (*status == 0) psrfits_find_cols(pf);
+    if (*status == 0)
+        *status = psrfits_alloc_subint(sub, hdr->nchan, hdr->npol);
 
     if (mode==SEARCH_MODE) 
         sub->bytes_per_subint = 
@@ -113,24 +439,48 @@ int psrfits_open(struct psrfits *pf) {
         sub->bytes_per_subint = 
             (hdr->nbin * hdr->nchan * hdr->npol); // XXX data type??
 
+    // Map the file if we can, else (re)size the data buffer for it
+    if (*status == 0) psrfits_map(pf);
+    if (*status == 0 && !pf->map && psrfits_alloc_data(pf) != 0)
+        *status = MEMORY_ALLOCATION;
 
-    printf("%d bits per sample\n",hdr->nbits);
-    printf("%d frequency channels\n",hdr->nchan);
-    printf("%d samples per block\n",hdr->nsblk);
-    printf("%d polarizations\n",hdr->npol);
+    if (!pf->quiet) {
+        printf("%d bits per sample\n",hdr->nbits);
+        printf("%d frequency channels\n",hdr->nchan);
+        printf("%d samples per block\n",hdr->nsblk);
+        printf("%d polarizations\n",hdr->npol);
+    }
 
     // Init counters
     pf->rownum = 1;
     fits_read_key(pf->fptr, TINT, "NAXIS2", &(pf->rows_per_file), NULL, status);
+    if (*status == 0 && pf->follow) psrfits_complete_rows(pf);
 
     return *status;
 }
 
+/* The bundled CFITSIO is not reentrant (its I/O buffers are global):
+ * readers running side by side hand it one lock.
+ */
+static void cfitsio_lock(struct psrfits *pf) {
+    if (pf->cfitsio_lock) pthread_mutex_lock(pf->cfitsio_lock);
+}
+
+static void cfitsio_unlock(struct psrfits *pf) {
+    if (pf->cfitsio_lock) pthread_mutex_unlock(pf->cfitsio_lock);
+}
+
 /* Read next subint from the set of files described
  * by the psrfits struct.  It is assumed that all files
  * form a consistent set.  Read automatically goes to the
- * next file when one ends.  Arrays should be allocated
- * outside this routine.
+ * next file when one ends.  data8/data16 point into the
+ * mapped file (see psrfits_map) or the reader's own buffer
+ * (see psrfits_alloc_data) and are only valid until the
+ * next call; the dat_ arrays are sized by psrfits_open.
+ * 1-, 2- and 4-bit samples are unpacked to a byte each, with
+ * data_bytes the size at data8.  With pf->decode set,
+ * sub->decoded also gets the calibrated samples (see
+ * decode_psrfits.c).
  */
 int psrfits_read_subint(struct psrfits *pf) {
 
@@ -138,12 +488,24 @@ int psrfits_read_subint(struct psrfits *pf) {
     struct subint  *sub = &(pf->sub);
     int *status = &(pf->status);
 
+    // Nothing open (a failed open or seek)
+    if (!pf->fptr) { return *status = FILE_NOT_OPENED; }
+
     // See if we need to move to next file
     //printf("%d %d\n",pf->rownum,pf->rows_per_file);
-    if (pf->rownum > pf->rows_per_file) {
+    if (pf->rownum > pf->rows_per_file && pf->follow) {
+      // Still being written: wait for the next row
+      if (psrfits_follow(pf) != 0) {
+	return *status;
+      }
+    } else if (pf->rownum > pf->rows_per_file) {
+      cfitsio_lock(pf);
+      psrfits_unmap(pf);
       fits_close_file(pf->fptr, status);
       pf->filenum++;
-      if (psrfits_open(pf) != 0) {
+      psrfits_open(pf);
+      cfitsio_unlock(pf);
+      if (*status) {
 	return *status;
       }
     }
@@ -153,52 +515,83 @@ int psrfits_read_subint(struct psrfits *pf) {
     int nivals = hdr->nchan * hdr->npol;
     int row = pf->rownum;
 
-    // TODO: bad! really need to base this on column names
-    fits_read_col(pf->fptr, TDOUBLE, 1, row, 1, 1, NULL, &(sub->tsubint), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 2, row, 1, 1, NULL, &(sub->offs), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 3, row, 1, 1, NULL, &(sub->lst), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 4, row, 1, 1, NULL, &(sub->ra), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 5, row, 1, 1, NULL, &(sub->dec), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 6, row, 1, 1, NULL, &(sub->glon), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 7, row, 1, 1, NULL, &(sub->glat), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 8, row, 1, 1, NULL, &(sub->feed_ang), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 9, row, 1, 1, NULL, &(sub->pos_ang), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 10, row, 1, 1, NULL, &(sub->par_ang), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 11, row, 1, 1, NULL, &(sub->tel_az), 
-            NULL, status);
-    fits_read_col(pf->fptr, TDOUBLE, 12, row, 1, 1, NULL, &(sub->tel_zen), 
-            NULL, status);
-    fits_read_col(pf->fptr, TFLOAT, 13, row, 1, nchan, NULL, sub->dat_freqs,
-            NULL, status);
-    fits_read_col(pf->fptr, TFLOAT, 14, row, 1, nchan, NULL, sub->dat_weights,
-            NULL, status);
-    fits_read_col(pf->fptr, TFLOAT, 15, row, 1, nivals, NULL, sub->dat_offsets,
-            NULL, status);
-    fits_read_col(pf->fptr, TFLOAT, 16, row, 1, nivals, NULL, sub->dat_scales,
-            NULL, status);
-
-    if (hdr->nbits==8) {
-      sub->data8=malloc(sizeof(char)*sub->bytes_per_subint);
-      fits_read_col(pf->fptr, TBYTE, 17, row, 1, (sub->bytes_per_subint),
-		  NULL, sub->data8, NULL, status);
+    struct subint_cols *cols = &(pf->cols);
+    double *scalars[PSRFITS_NSCALAR] = {
+        &(sub->tsubint), &(sub->offs), &(sub->lst), &(sub->ra), &(sub->dec),
+        &(sub->glon), &(sub->glat), &(sub->feed_ang), &(sub->pos_ang),
+        &(sub->par_ang), &(sub->tel_az), &(sub->tel_zen)
+    };
+    int i;
+
+    // A mapped row may have been charged already, when its pages were
+    // asked for (below)
+    if (!pf->map || pf->map_charged != row)
+        psrfits_throttle(pf, PSRFITS_THROTTLE_READ, sub->bytes_per_subint);
+    cfitsio_lock(pf);
+    if (cols->nbytes) {
+        // All the scalars of the row in one read
+        unsigned char buf[PSRFITS_SCALAR_BYTES];
+        fits_read_tblbytes(pf->fptr, row, cols->first_byte + 1, cols->nbytes,
+                buf, status);
+        // buf is only filled in if the read worked
+        for (i = 0; i < PSRFITS_NSCALAR; i++)
+            *scalars[i] = (cols->scalar[i] && *status == 0) ? scalar_value(buf +
+                    cols->scalar_byte[i] - cols->first_byte,
+                    cols->scalar_type[i]) : 0.0;
     } else {
-      sub->data16=malloc(sizeof(short)*sub->bytes_per_subint);
-      fits_read_col(pf->fptr, TBYTE, 17, row, 1, (sub->bytes_per_subint),
-		  NULL, sub->data16, NULL, status);
+        for (i = 0; i < PSRFITS_NSCALAR; i++) {
+            *scalars[i] = 0.0;
+            if (cols->scalar[i])
+                fits_read_col(pf->fptr, TDOUBLE, cols->scalar[i], row, 1, 1,
+                        NULL, scalars[i], NULL, status);
+        }
     }
+    fits_read_col(pf->fptr, TFLOAT, cols->dat_freq, row, 1, nchan, NULL,
+            sub->dat_freqs, NULL, status);
+    fits_read_col(pf->fptr, TFLOAT, cols->dat_wts, row, 1, nchan, NULL,
+            sub->dat_weights, NULL, status);
+    fits_read_col(pf->fptr, TFLOAT, cols->dat_offs, row, 1, nivals, NULL,
+            sub->dat_offsets, NULL, status);
+    fits_read_col(pf->fptr, TFLOAT, cols->dat_scl, row, 1, nivals, NULL,
+            sub->dat_scales, NULL, status);
+
+    if (pf->map) {
+        // Straight out of the mapped file; ask for the next row meanwhile
+        cfitsio_unlock(pf);
+        unsigned char *data = pf->map + pf->map_row1 + (row - 1) * pf->map_rowlen;
+        sub->data8 = data;
+        sub->data16 = (unsigned short *)data;
+        // With bandwidth limits, fault the row in now that the throttle
+        // has let it through, not whenever the consumer gets to it
+        if (pf->throttle) psrfits_touch(data, sub->bytes_per_subint);
+        if (row < pf->rows_per_file) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            uintptr_t next = (uintptr_t)(data + pf->map_rowlen) & ~(page - 1);
+            // The read ahead is what goes to disk: charge it first
+            psrfits_throttle(pf, PSRFITS_THROTTLE_READ, sub->bytes_per_subint);
+            pf->map_charged = row + 1;
+            madvise((void *)next, sub->bytes_per_subint + page, MADV_WILLNEED);
+        }
+    } else {
+        // Into the buffer sized by psrfits_open
+        sub->data8 = sub->data_buf;
+        sub->data16 = (unsigned short *)sub->data_buf;
+        fits_read_col(pf->fptr, TBYTE, cols->data, row, 1, (sub->bytes_per_subint),
+                NULL, sub->data8, NULL, status);
+        cfitsio_unlock(pf);
+    }
+
+    // One byte per sample for 1, 2 and 4 bits, and a calibrated copy if
+    // asked for
+    sub->data_bytes = sub->bytes_per_subint;
+    if (!(*status) && hdr->nbits < 8 && mode == SEARCH_MODE)
+        psrfits_unpack_subint(pf);
+    if (!(*status) && pf->decode) psrfits_decode_subint(pf);
 
     // Complain on error
+    cfitsio_lock(pf);
     fits_report_error(stderr, *status);
+    cfitsio_unlock(pf);
 
     // Update counters
     if (!(*status)) {
@@ -210,3 +603,75 @@ int psrfits_read_subint(struct psrfits *pf) {
 
     return *status;
 }
+
+/* Position the reader so that the next psrfits_read_subint returns the
+ * subint holding sample `sample` of the observation (counted from the
+ * start of subint 0, NSUBOFFS = 0).  Only that file is opened: its number
+ * is worked out from the open file's NSUBOFFS and NAXIS2 and checked
+ * against the NSUBOFFS of the file it lands on.  On success pf->N is the
+ * first sample of that subint, so sample - pf->N samples of it come
+ * before the one asked for.  A sample outside the file set returns an
+ * error and leaves the reader at the start of the file it had open, ready
+ * to read (pf->status 0, pf->N its first sample).  Not while
+ * prefetching.
+ */
+int psrfits_seek_sample(struct psrfits *pf, long long sample) {
+
+    struct hdrinfo *hdr = &(pf->hdr);
+    int *status = &(pf->status);
+    long long target, step;
+    int tries, prev;
+
+    if (pf->prefetch || hdr->nsblk <= 0 || sample < 0) {
+        return *status = BAD_ROW_NUM;
+    }
+    target = sample / hdr->nsblk;
+
+    for (tries = 0; tries < 64; tries++) {
+        if (pf->fptr && target >= hdr->offset_subint &&
+            target < (long long)hdr->offset_subint + pf->rows_per_file) {
+            pf->rownum = (int)(target - hdr->offset_subint) + 1;
+            pf->N = target * hdr->nsblk;
+            pf->T = pf->N * hdr->dt;
+            return *status = 0;
+        }
+        // Files of a set hold the same number of rows, bar the last one
+        if (pf->fptr && pf->rows_per_file > 0) {
+            step = target - hdr->offset_subint;
+            step = step >= 0 ? step / pf->rows_per_file
+                             : -((-step + pf->rows_per_file - 1) / pf->rows_per_file);
+            if (step == 0) step = 1;  // past the end of a short file
+        } else {
+            step = 0;  // not open: just retry the current number
+        }
+        if (pf->fptr) {
+            psrfits_unmap(pf);
+            fits_close_file(pf->fptr, status);
+            pf->fptr = NULL;
+        }
+        *status = 0;
+        prev = pf->filenum;
+        pf->filenum += (int)step;
+        if (pf->filenum < 1 || psrfits_open(pf) != 0) {
+            // Out of the set: leave the reader where it was
+            int err = pf->filenum < 1 ? BAD_ROW_NUM : *status;
+            if (pf->fptr) { psrfits_unmap(pf); fits_close_file(pf->fptr, status); }
+            pf->fptr = NULL;
+            pf->filenum = prev;
+            *status = 0;
+            if (psrfits_open(pf) != 0) { return *status; }
+            pf->N = (long long)hdr->offset_subint * hdr->nsblk;
+            pf->T = pf->N * hdr->dt;
+            return err;  // the reader itself is fine
+        }
+    }
+    return *status = BAD_ROW_NUM;
+}
+
+/* As psrfits_seek_sample, for the sample at t seconds from the start of
+ * the observation.
+ */
+int psrfits_seek_time(struct psrfits *pf, double t) {
+    if (pf->hdr.dt <= 0.0 || t < 0.0) { return pf->status = BAD_ROW_NUM; }
+    return psrfits_seek_sample(pf, (long long)(t / pf->hdr.dt));
+}
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include "filhdr.h"
 int strings_equal (char *string1, char *string2) /* includefile */
 {
   if (!strcmp(string1,string2)) {
@@ -164,18 +166,9 @@ void swap_longlong( long long *pl ) /* includefile */
   pc[4] = t;
 }
 
-#include <stdio.h>
 int little_endian() /*includefile*/
 {
-  char *ostype;
-
-  if (strings_equal(ostype,"linux")) return 1;
-  if (strings_equal(ostype,"hpux")) return 0;
-  if (strings_equal(ostype,"solaris")) return 0;
-  if (strings_equal(ostype,"darwin")) return 0;
-  fprintf(stderr,"Your OSTYPE environment variable is defined but not recognized!\n");
-  fprintf(stderr,"Consult and edit little_endian in swap_bytes.c and then recompile\n");
-  fprintf(stderr,"the code if necessary... Contact dunc@naic.edu for further help\n");
+  return !FILHDR_BIG_ENDIAN;
 }
 
 int big_endian() /*includefile*/
@@ -183,55 +176,93 @@ int big_endian() /*includefile*/
   return (!little_endian());
 }
 
-FILE *input, *output;
-int swapout;
-void send_string(char *string) /* includefile */
+/*
+	A SIGPROC header built in memory (struct filhdr, filhdr.h) and
+	written with a single call.  These replace the send_* writers,
+	which wrote each keyword straight to the global FILE *output.
+*/
+void filhdr_init(struct filhdr *h, int swap) /* includefile */
+{
+  h->buf=NULL;
+  h->len=h->size=0;
+  h->swap=swap;
+  h->status=0;
+}
+
+void filhdr_free(struct filhdr *h) /* includefile */
+{
+  free(h->buf);
+  filhdr_init(h,h->swap);
+}
+
+/* n bytes at p onto the end, reversed if swapping (numbers only) */
+static void filhdr_put(struct filhdr *h, const void *p, size_t n, int number)
+{
+  size_t i;
+  if (h->status) return;
+  if (h->len+n>h->size) {
+    size_t size=h->size ? 2*h->size : 1024;
+    unsigned char *buf;
+    while (size<h->len+n) size*=2;
+    buf=(unsigned char *)realloc(h->buf,size);
+    if (!buf) {
+      h->status=-1;
+      return;
+    }
+    h->buf=buf;
+    h->size=size;
+  }
+  if (number && h->swap)
+    for (i=0;i<n;i++) h->buf[h->len+i]=((const unsigned char *)p)[n-1-i];
+  else
+    memcpy(h->buf+h->len,p,n);
+  h->len+=n;
+}
+
+void filhdr_string(struct filhdr *h, const char *string) /* includefile */
+{
+  int len=strlen(string);
+  filhdr_put(h,&len,sizeof(int),1);
+  filhdr_put(h,string,len,0);
+}
+
+void filhdr_int(struct filhdr *h, const char *name, int integer) /* includefile */
 {
-  int len;
-  len=strlen(string);
-  if (swapout) swap_int(&len);
-  fwrite(&len, sizeof(int), 1, output);
-  if (swapout) swap_int(&len);
-  fwrite(string, sizeof(char), len, output);
-  /*fprintf(stderr,"%s\n",string);*/
+  filhdr_string(h,name);
+  filhdr_put(h,&integer,sizeof(int),1);
 }
 
-void send_float(char *name,float floating_point) /* includefile */
+void filhdr_long(struct filhdr *h, const char *name, long integer) /* includefile */
 {
-  send_string(name);
-  if (swapout) swap_float(&floating_point);
-  fwrite(&floating_point,sizeof(float),1,output);
-  /*fprintf(stderr,"%f\n",floating_point);*/
+  filhdr_string(h,name);
+  filhdr_put(h,&integer,sizeof(long),1);
 }
 
-void send_double (char *name, double double_precision) /* includefile */
+void filhdr_float(struct filhdr *h, const char *name, float floating_point) /* includefile */
 {
-  send_string(name);
-  if (swapout) swap_double(&double_precision);
-  fwrite(&double_precision,sizeof(double),1,output);
-  /*fprintf(stderr,"%f\n",double_precision);*/
+  filhdr_string(h,name);
+  filhdr_put(h,&floating_point,sizeof(float),1);
 }
 
-void send_int(char *name, int integer) /* includefile */
+void filhdr_double(struct filhdr *h, const char *name, double double_precision) /* includefile */
 {
-  send_string(name);
-  if (swapout) swap_int(&integer);
-  fwrite(&integer,sizeof(int),1,output);
-  /*fprintf(stderr,"%d\n",integer);*/
+  filhdr_string(h,name);
+  filhdr_put(h,&double_precision,sizeof(double),1);
 }
 
-void send_long(char *name, long integer) /* includefile */
+/* all four: the old send_coords meant to skip 0 and -1, but its tests
+   were always true */
+void filhdr_coords(struct filhdr *h, double raj, double dej, double az, double za) /*includefile*/
 {
-  send_string(name);
-  if (swapout) swap_long(&integer);
-  fwrite(&integer,sizeof(long),1,output);
-  /*fprintf(stderr,"%ld\n",integer);*/
+  filhdr_double(h,"src_raj",raj);
+  filhdr_double(h,"src_dej",dej);
+  filhdr_double(h,"az_start",az);
+  filhdr_double(h,"za_start",za);
 }
 
-void send_coords(double raj, double dej, double az, double za) /*includefile*/
+/* The whole header at the current position of fp; 0 if it all went */
+int filhdr_write(const struct filhdr *h, FILE *fp) /* includefile */
 {
-  if ((raj != 0.0) || (raj != -1.0)) send_double("src_raj",raj);
-  if ((dej != 0.0) || (dej != -1.0)) send_double("src_dej",dej);
-  if ((az != 0.0)  || (az != -1.0))  send_double("az_start",az);
-  if ((za != 0.0)  || (za != -1.0))  send_double("za_start",za);
+  if (h->status) return -1;
+  return (fwrite(h->buf,1,h->len,fp)==h->len) ? 0 : -1;
 }
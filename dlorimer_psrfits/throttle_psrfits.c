@@ -0,0 +1,139 @@
+/* throttle_psrfits.c
+ * Limits on the bandwidth a conversion reads and writes, so that it can
+ * run on the recording host next to a live capture.
+ *
+ * Reads and writes each have a token bucket filled at their rate and
+ * holding at most a quarter of a second's worth; psrfits_throttle takes
+ * the bytes about to be moved out of it and sleeps off any debt, so the
+ * reader thread and any number of writers share the same budget.  With
+ * a disk named (as in /proc/diskstats), its average write latency is
+ * looked at once a second: above the limit both rates are halved, down
+ * to 1/64 of what was asked for, and below it they double back.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "psrfits.h"
+
+// Slowest the disk's latency can push the rates, as a fraction of them
+#define PSRFITS_THROTTLE_MIN_SCALE (1.0 / 64)
+
+struct psrfits_throttle {
+    double rate[2];         // Bytes/s asked for (read, write); 0: no limit
+    double tokens[2];       // Bytes that can go now (negative: owed)
+    double scale;           // Fraction of the rates allowed at the moment
+    double last;            // When the buckets were last filled
+    char disk[32];          // Whose write latency to watch ("": none)
+    double max_latency;     // ms per write before backing off
+    unsigned long long writes, write_ms; // Its counters when last looked at
+    double looked;          // ...which was then
+    pthread_mutex_t lock;
+};
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// Writes completed and ms spent writing by disk; -1 if it isn't there
+static int disk_counters(const char *disk, unsigned long long *writes,
+                         unsigned long long *ms) {
+    FILE *f = fopen("/proc/diskstats", "r");
+    char line[512], name[32];
+    int found = -1;
+
+    if (!f) { return -1; }
+    while (found && fgets(line, sizeof(line), f))
+        if (sscanf(line, "%*u %*u %31s %*u %*u %*u %*u %llu %*u %*u %llu",
+                   name, writes, ms) == 3 && strcmp(name, disk) == 0)
+            found = 0;
+    fclose(f);
+    return found;
+}
+
+// Back off or recover from the latency of the disk since the last look
+static void watch_disk(struct psrfits_throttle *t, double now) {
+    unsigned long long writes, ms;
+
+    if (!t->disk[0] || now - t->looked < 1.0) { return; }
+    t->looked = now;
+    if (disk_counters(t->disk, &writes, &ms) != 0) { return; }
+    if (writes > t->writes &&
+        (double)(ms - t->write_ms) / (writes - t->writes) > t->max_latency) {
+        t->scale *= 0.5;
+        if (t->scale < PSRFITS_THROTTLE_MIN_SCALE) t->scale = PSRFITS_THROTTLE_MIN_SCALE;
+    } else {
+        t->scale *= 2.0;
+        if (t->scale > 1.0) t->scale = 1.0;
+    }
+    t->writes = writes;
+    t->write_ms = ms;
+}
+
+/* Limit the reads and writes of pf (and of anything that shares its
+ * pf->throttle) to read_mbs and write_mbs MB/s, 0 for no limit.  With
+ * disk non-NULL, slow down while its writes take longer than
+ * max_latency ms on average.
+ */
+int psrfits_throttle_start(struct psrfits *pf, double read_mbs, double write_mbs,
+                           const char *disk, double max_latency) {
+
+    struct psrfits_throttle *t;
+
+    t = (struct psrfits_throttle *)calloc(1, sizeof(*t));
+    if (!t) { return pf->status = MEMORY_ALLOCATION; }
+    t->rate[PSRFITS_THROTTLE_READ] = read_mbs * 1e6;
+    t->rate[PSRFITS_THROTTLE_WRITE] = write_mbs * 1e6;
+    t->scale = 1.0;
+    t->last = t->looked = now_s();
+    if (disk) {
+        strncpy(t->disk, disk, sizeof(t->disk) - 1);
+        t->max_latency = max_latency;
+        if (disk_counters(t->disk, &t->writes, &t->write_ms) != 0)
+            fprintf(stderr, "Warning: no disk %s in /proc/diskstats\n", disk);
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    pf->throttle = t;
+    return 0;
+}
+
+/* Wait until bytes can be read or written (dir PSRFITS_THROTTLE_READ or
+ * _WRITE) within the limits.  Does nothing without psrfits_throttle_start.
+ */
+void psrfits_throttle(struct psrfits *pf, int dir, size_t bytes) {
+
+    struct psrfits_throttle *t = pf->throttle;
+    double now, wait = 0.0;
+    int d;
+
+    if (!t || t->rate[dir] <= 0.0) { return; }
+    pthread_mutex_lock(&t->lock);
+    now = now_s();
+    watch_disk(t, now);
+    for (d = 0; d < 2; d++) {
+        double rate = t->rate[d] * t->scale;
+        t->tokens[d] += (now - t->last) * rate;
+        if (t->tokens[d] > 0.25 * rate) t->tokens[d] = 0.25 * rate;
+    }
+    t->last = now;
+    t->tokens[dir] -= bytes;
+    if (t->tokens[dir] < 0.0) wait = -t->tokens[dir] / (t->rate[dir] * t->scale);
+    pthread_mutex_unlock(&t->lock);
+
+    if (wait > 0.0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+void psrfits_throttle_stop(struct psrfits *pf) {
+    if (!pf->throttle) { return; }
+    pthread_mutex_destroy(&pf->throttle->lock);
+    free(pf->throttle);
+    pf->throttle = NULL;
+}
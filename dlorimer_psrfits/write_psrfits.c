@@ -200,6 +200,13 @@ int psrfits_write_subint(struct psrfits *pf) {
     nivals = hdr->nchan * hdr->npol;
     mode = psrfits_obs_mode(hdr->obs_mode);
 
+    // The dat_ arrays must be sized (psrfits_alloc_subint) for this header
+    if (!sub->dat_freqs || sub->dat_nchan != nchan || sub->dat_npol != hdr->npol) {
+        fprintf(stderr, "Error: subint arrays not allocated for %d channels x %d pols\n",
+                nchan, hdr->npol);
+        return *status = MEMORY_ALLOCATION;
+    }
+
     // Create the initial file or change to a new one if needed
     if (pf->filenum == 0 || pf->rownum > pf->rows_per_file) {
         if (pf->filenum) {
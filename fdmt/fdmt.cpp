@@ -0,0 +1,221 @@
+/* fdmt.cpp
+ * Native FDMT engine: runs a plan (fdmt_plan.cpp) over an image, with the
+ * work of each step spread over a thread pool.
+ *
+ * The transform itself is described in bin/fdmt.py; the comments here
+ * only cover what differs from it.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fdmt.h"
+#include "fdmt_kernels.h"
+#include "fdmt_plan.h"
+#include "thread_pool.h"
+
+/* ------------------------------------------------------------------------ */
+/* Thread pool                                                              */
+/* ------------------------------------------------------------------------ */
+
+static std::mutex pool_mutex;
+static std::shared_ptr<ThreadPool> pool_ptr;
+static int pool_nthreads = 0;
+
+static int default_num_threads(void) {
+    const char *env = getenv("FDMT_NUM_THREADS");
+    if (env && atoi(env) > 0) return atoi(env);
+    int n = (int)std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// Returned by shared_ptr so a resize never pulls the pool from under a
+// transform that is still running on it.
+std::shared_ptr<ThreadPool> fdmt_pool(void) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (pool_nthreads <= 0) pool_nthreads = default_num_threads();
+    if (!pool_ptr || pool_ptr->size() != pool_nthreads)
+        pool_ptr.reset(new ThreadPool(pool_nthreads));
+    return pool_ptr;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Transform                                                                */
+/* ------------------------------------------------------------------------ */
+
+// View of one level's state cubes [n_batch][n_f][n_d][n_s]
+template <typename T>
+struct State {
+    T *data;
+    int n_batch, n_f, n_d, n_s;
+    State(T *p, int batch, int f, int d, int s) : data(p), n_batch(batch), n_f(f), n_d(d), n_s(s) {}
+    size_t cube() const { return (size_t)n_f * n_d * n_s; }
+    T *row(int b, long r) const { return data + b * cube() + (size_t)r * n_s; }
+    T *row(int b, int i_f, int i_d) const { return row(b, (long)i_f * n_d + i_d); }
+};
+
+// Every cell of the initialized state is written here, including the
+// leading zeros of each delay row, so the buffer need not be cleared.
+template <typename T>
+static void initialize(const T *image, const State<T> &state, ThreadPool &tp) {
+    const int n_s = state.n_s, n_f = state.n_f;
+    tp.parallel_for((long)state.n_batch * n_f, [&](long j) {
+        const int b = (int)(j / n_f), i_f = (int)(j % n_f);
+        const T *in = image + (size_t)j * n_s;
+        memcpy(state.row(b, i_f, 0), in, sizeof(T) * n_s);
+        for (int i_dt = 1; i_dt < state.n_d; i_dt++) {
+            const T *prev = state.row(b, i_f, i_dt - 1);
+            T *cur = state.row(b, i_f, i_dt);
+            memset(cur, 0, sizeof(T) * std::min(i_dt, n_s));
+            if (i_dt < n_s) fdmt_add(cur + i_dt, prev + i_dt, in, n_s - i_dt);
+        }
+    });
+}
+
+// One merge iteration: every output row is independent, so they are handed
+// out one at a time, which keeps all threads busy even in the last
+// iterations where only a few sub-bands are left. In a batch the rows of
+// all images go into the same queue.
+template <typename T>
+static void iterate(const std::vector<FdmtMerge> &merges, const State<T> &in,
+                    const State<T> &out, ThreadPool &tp) {
+    const long n_s = out.n_s, n_m = (long)merges.size();
+    tp.parallel_for(out.n_batch * n_m, [&](long j) {
+        const int i_b = (int)(j / n_m);
+        const FdmtMerge &m = merges[j % n_m];
+        const T *a = in.row(i_b, m.mid_row);
+        const T *b = in.row(i_b, m.rest_row);
+        T *o = out.row(i_b, m.out_row);
+        long split = std::min<long>(m.shift, n_s);
+        memcpy(o, a, sizeof(T) * split);
+        if (split < n_s) fdmt_add(o + split, a + split, b, n_s - split);
+    });
+}
+
+// Grow plan->arena[i] to at least `bytes`, cache-line aligned. The old
+// contents are not kept.
+static int reserve_arena(fdmt_plan *plan, int i, size_t bytes) {
+    if (plan->arena_bytes[i] >= bytes) return FDMT_OK;
+    free(plan->arena[i]);
+    plan->arena[i] = NULL;
+    plan->arena_bytes[i] = 0;
+    void *p;
+    if (posix_memalign(&p, 64, bytes)) return FDMT_ERR_MEMORY;
+    plan->arena[i] = p;
+    plan->arena_bytes[i] = bytes;
+    return FDMT_OK;
+}
+
+// The levels ping-pong between the plan's two arena buffers; the last one
+// is written straight into `out`. Nothing is allocated once the arena has
+// grown to fit n_batch x n_s, and only the cells an iteration reads without
+// writing are cleared.
+template <typename T>
+static int execute(fdmt_plan *plan, const T *image, int n_batch, int n_s, T *out) {
+    std::shared_ptr<ThreadPool> pool_ref = fdmt_pool();
+    ThreadPool &tp = *pool_ref;
+    std::lock_guard<std::mutex> lock(plan->arena_mutex);
+
+    size_t need[2] = {0, 0};
+    for (int l = 0; l < plan->n_iter; l++)
+        need[l % 2] = std::max(need[l % 2],
+                               (size_t)n_batch * plan->state_rows(l) * n_s * sizeof(T));
+    for (int i = 0; i < 2; i++) {
+        int status = reserve_arena(plan, i, need[i]);
+        if (status) return status;
+    }
+    auto level = [&](int l) {
+        if (l == plan->n_iter) return State<T>(out, n_batch, 1, plan->output_rows(), n_s);
+        return State<T>((T *)plan->arena[l % 2], n_batch, plan->sub_bands(l), plan->n_d[l], n_s);
+    };
+
+    State<T> state = level(0);
+    initialize(image, state, tp);
+    for (int l = 1; l <= plan->n_iter; l++) {
+        State<T> next = level(l);
+        for (int b = 0; b < n_batch; b++)
+            for (int32_t r : plan->zero_rows[l]) memset(next.row(b, (long)r), 0, sizeof(T) * n_s);
+        iterate(plan->merges[l - 1], state, next, tp);
+        state = next;
+    }
+    return FDMT_OK;
+}
+
+/* ------------------------------------------------------------------------ */
+/* C interface                                                              */
+/* ------------------------------------------------------------------------ */
+
+extern "C" {
+
+const char *fdmt_strerror(int status) {
+    switch (status) {
+    case FDMT_OK: return "success";
+    case FDMT_ERR_NF: return "number of frequency channels must be a power of 2";
+    case FDMT_ERR_DTYPE: return "unsupported dtype";
+    case FDMT_ERR_INDEX: return "delay index out of range (check f_min, f_max, maxDT)";
+    case FDMT_ERR_ARG: return "invalid argument";
+    case FDMT_ERR_MEMORY: return "out of memory";
+    case FDMT_ERR_IO: return "could not write, read or parse plan file";
+    }
+    return "unknown error";
+}
+
+void fdmt_set_num_threads(int nthreads) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    pool_nthreads = nthreads > 0 ? nthreads : default_num_threads();
+}
+
+int fdmt_get_num_threads(void) { return fdmt_pool()->size(); }
+
+const char *fdmt_simd(void) { return fdmt_kernels().name; }
+
+int fdmt_plan_execute(fdmt_plan *plan, const void *image, int n_s, int dtype, void *out) {
+    return fdmt_plan_execute_batch(plan, image, 1, n_s, dtype, out);
+}
+
+int fdmt_plan_execute_batch(fdmt_plan *plan, const void *image, int n_batch, int n_s, int dtype,
+                            void *out) {
+    if (n_batch <= 0 || n_s <= 0) return FDMT_ERR_ARG;
+    switch (dtype) {
+    case FDMT_FLOAT32:
+        return execute(plan, (const float *)image, n_batch, n_s, (float *)out);
+    case FDMT_FLOAT64:
+        return execute(plan, (const double *)image, n_batch, n_s, (double *)out);
+    case FDMT_INT32:
+        return execute(plan, (const int32_t *)image, n_batch, n_s, (int32_t *)out);
+    case FDMT_INT64:
+        return execute(plan, (const int64_t *)image, n_batch, n_s, (int64_t *)out);
+    case FDMT_INT16:
+        return execute(plan, (const int16_t *)image, n_batch, n_s, (int16_t *)out);
+    case FDMT_FLOAT16:
+        return execute(plan, (const fdmt_half *)image, n_batch, n_s, (fdmt_half *)out);
+    }
+    return FDMT_ERR_DTYPE;
+}
+
+int fdmt_output_rows(int n_f, double f_min, double f_max, int max_dt) {
+    fdmt_plan *plan;
+    int status = fdmt_plan_create(n_f, f_min, f_max, max_dt, &plan);
+    if (status) return -status;
+    int rows = plan->output_rows();
+    fdmt_plan_destroy(plan);
+    return rows;
+}
+
+int fdmt_execute(const void *image, int n_f, int n_s, double f_min,
+                 double f_max, int max_dt, int dtype, void *out) {
+    fdmt_plan *plan;
+    int status = fdmt_plan_create(n_f, f_min, f_max, max_dt, &plan);
+    if (status) return status;
+    status = fdmt_plan_execute(plan, image, n_s, dtype, out);
+    fdmt_plan_destroy(plan);
+    return status;
+}
+
+}  // extern "C"
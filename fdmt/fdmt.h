@@ -0,0 +1,111 @@
+/* fdmt.h
+ * Native Fast Discrete Dispersion Measure Transform (Zackay & Ofek 2017).
+ *
+ * A compiled version of the kernel in bin/fdmt.py. The index arithmetic is
+ * evaluated exactly as the Python does it, so for the same input and dtype
+ * the output is bit-for-bit identical (checked by bin/fdmt_validate.py).
+ * The C interface is what bin/fdmt.py loads through ctypes.
+ */
+#ifndef _FDMT_H
+#define _FDMT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Element types of the image and of the state cube (numpy dtype names).
+// Integer sums wrap on overflow, as in numpy: see fdmt_plan_max_terms.
+// float16 is stored as binary16 and each add is done in float32.
+#define FDMT_FLOAT32 0
+#define FDMT_FLOAT64 1
+#define FDMT_INT32   2
+#define FDMT_INT64   3
+#define FDMT_INT16   4
+#define FDMT_FLOAT16 5
+
+// Return codes
+#define FDMT_OK        0
+#define FDMT_ERR_NF    1  // N_f is not a power of 2
+#define FDMT_ERR_DTYPE 2  // Unsupported element type
+#define FDMT_ERR_INDEX 3  // A delay row fell outside the state (bad f_min/f_max/maxDT)
+#define FDMT_ERR_ARG   4  // Other bad argument (sizes <= 0, ...)
+#define FDMT_ERR_MEMORY 5 // Could not allocate the state
+#define FDMT_ERR_IO    6  // Plan file could not be written, read or was invalid
+
+const char *fdmt_strerror(int status);
+
+// Number of worker threads used by the transforms. Defaults to the
+// FDMT_NUM_THREADS environment variable, else the number of cores.
+void fdmt_set_num_threads(int nthreads);
+int fdmt_get_num_threads(void);
+
+// Instruction set of the inner loops: "avx512", "avx2", "sse4.2" or
+// "scalar". The widest the CPU supports unless FDMT_SIMD names another.
+const char *fdmt_simd(void);
+
+// A plan holds every shift and row index of the transform for one
+// (N_f, f_min, f_max, maxDT). Build it once per observation (or load it
+// from disk) and run it on every chunk.
+typedef struct fdmt_plan fdmt_plan;
+
+int fdmt_plan_create(int n_f, double f_min, double f_max, int max_dt, fdmt_plan **plan);
+void fdmt_plan_destroy(fdmt_plan *plan);
+void fdmt_plan_params(const fdmt_plan *plan, int *n_f, double *f_min, double *f_max, int *max_dt);
+int fdmt_plan_output_rows(const fdmt_plan *plan);
+
+// A plan whose output starts at total delay min_dt: row r of the output is
+// row min_dt + r of the full transform, and the partial sums that could
+// only reach rows below min_dt are never computed. Needs n_f >= 2.
+int fdmt_plan_create_range(int n_f, double f_min, double f_max, int min_dt, int max_dt,
+                           fdmt_plan **plan);
+int fdmt_plan_min_dt(const fdmt_plan *plan);
+
+// The most input samples summed into any one cell of the state, at any
+// level. Inputs bounded by |x| <= M never overflow an integer dtype whose
+// largest value is at least max_terms * M.
+long long fdmt_plan_max_terms(const fdmt_plan *plan);
+int fdmt_plan_save(const fdmt_plan *plan, const char *filename);
+int fdmt_plan_load(const char *filename, fdmt_plan **plan);
+
+// Transform image[n_f][n_s] (channel 0 == f_min) into
+// out[fdmt_plan_output_rows(plan)][n_s]. Both arrays are C-contiguous of `dtype`.
+// The intermediate state lives in two buffers owned by the plan, allocated
+// on first use and kept for later calls (calls on one plan are serialized).
+int fdmt_plan_execute(fdmt_plan *plan, const void *image, int n_s, int dtype, void *out);
+
+// n_batch independent images at once (beams, polarization products,
+// chunks): image[n_batch][n_f][n_s] into out[n_batch][rows][n_s]. One pass
+// over the plan, with the rows of every image in the same thread queue; the
+// arena grows to n_batch times the single-image size.
+int fdmt_plan_execute_batch(fdmt_plan *plan, const void *image, int n_batch, int n_s, int dtype,
+                            void *out);
+
+// Free the plan's intermediate-state buffers until its next execute
+void fdmt_plan_release(fdmt_plan *plan);
+
+// A stream runs a plan over one continuous series delivered in blocks of
+// up to max_block samples. Each push transforms image[n_f][n] into
+// out[fdmt_plan_output_rows(plan)][n]: the next n columns of what
+// fdmt_plan_execute would give over the whole series so far, with no
+// overlap to re-send. The stream keeps the last maxDT-or-so samples of
+// every level; the plan must outlive it, and may be shared by any number
+// of streams and executes. Its memory does not grow with the series, so it
+// is also the way to transform a series too long to hold at once.
+typedef struct fdmt_stream fdmt_stream;
+
+int fdmt_stream_create(const fdmt_plan *plan, int max_block, int dtype, fdmt_stream **stream);
+void fdmt_stream_destroy(fdmt_stream *stream);
+int fdmt_stream_push(fdmt_stream *stream, const void *image, int n, void *out);
+long long fdmt_stream_position(const fdmt_stream *stream);  // samples pushed so far
+void fdmt_stream_reset(fdmt_stream *stream);  // start a new series
+
+// One-shot versions that build a throwaway plan
+int fdmt_output_rows(int n_f, double f_min, double f_max, int max_dt);
+int fdmt_execute(const void *image, int n_f, int n_s, double f_min,
+                 double f_max, int max_dt, int dtype, void *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,169 @@
+/* fdmt_bench.cpp
+ * Micro-benchmark for the FDMT inner loops.
+ *
+ * Reports, in GB/s of memory traffic:
+ *   - memcpy, as the reference for what this node's memory can do,
+ *   - the row add of every instruction set the CPU supports, both on rows
+ *     far bigger than the caches (should match memcpy: bandwidth bound)
+ *     and on rows that stay in L1 (shows the issue rate),
+ *   - a whole transform with the kernels the library would pick, in one
+ *     execute and as a stream fed in blocks, with the last-level cache
+ *     miss rate of each when the kernel lets us read the hardware counters
+ *     (perf_event_paranoid).
+ *
+ * usage: fdmt_bench (nchan) (nsamp) (maxDT) (reps) (block...)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "fdmt.h"
+#include "fdmt_kernels.h"
+#include "fdmt_plan.h"
+
+static double now(void) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Best time of `reps` runs of fn()
+template <typename F>
+static double best_of(int reps, F fn) {
+    double best = 1e30;
+    for (int i = 0; i < reps; i++) {
+        double t0 = now();
+        fn();
+        best = std::min(best, now() - t0);
+    }
+    return best;
+}
+
+// Last-level cache misses / references over one run of fn(), counting all
+// threads of this process; negative if the counters are not available.
+template <typename F>
+static double cache_miss_rate(F fn) {
+#ifdef __linux__
+    auto open_counter = [](unsigned long long config, int group) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = group < 0;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+    };
+    int refs = open_counter(PERF_COUNT_HW_CACHE_REFERENCES, -1);
+    if (refs < 0) return -1;
+    int misses = open_counter(PERF_COUNT_HW_CACHE_MISSES, refs);
+    if (misses < 0) {
+        close(refs);
+        return -1;
+    }
+    ioctl(refs, PERF_EVENT_IOC_RESET, 0);
+    ioctl(refs, PERF_EVENT_IOC_ENABLE, 0);
+    fn();
+    ioctl(refs, PERF_EVENT_IOC_DISABLE, 0);
+    long long n_refs = 0, n_misses = 0;
+    bool ok = read(refs, &n_refs, sizeof(n_refs)) == sizeof(n_refs) &&
+              read(misses, &n_misses, sizeof(n_misses)) == sizeof(n_misses);
+    close(misses);
+    close(refs);
+    return ok && n_refs > 0 ? (double)n_misses / n_refs : -1;
+#else
+    (void)fn;
+    return -1;
+#endif
+}
+
+int main(int argc, char **argv) {
+    int n_f = argc > 1 ? atoi(argv[1]) : 256;
+    int n_s = argc > 2 ? atoi(argv[2]) : 32768;
+    int max_dt = argc > 3 ? atoi(argv[3]) : 2000;
+    int reps = argc > 4 ? atoi(argv[4]) : 5;
+    const double f_min = 1300.0, f_max = 1500.0;
+
+    // Streaming rows: 3 x 128 MB, well past any last-level cache.
+    const long big = 32L << 20;
+    std::vector<float> a(big, 1.0f), b(big, 2.0f), o(big);
+    double t = best_of(reps, [&] { memcpy(o.data(), a.data(), big * sizeof(float)); });
+    double bw = 2.0 * big * sizeof(float) / t / 1e9;
+    printf("memcpy                      %7.2f GB/s\n", bw);
+
+    // In-cache rows: 3 x 4 KB, repeated
+    const long small = 1024, loops = 20000;
+    printf("row add      %-8s %12s %12s\n", "", "streaming", "in L1");
+    for (const FdmtKernels *k = fdmt_kernel_sets; k->name; k++) {
+        if (!fdmt_kernels_named(k->name)) continue;
+        double ts = best_of(reps, [&] { k->add_f32(o.data(), a.data(), b.data(), big); });
+        double tc = best_of(reps, [&] {
+            for (long i = 0; i < loops; i++) k->add_f32(o.data(), a.data() + 1, b.data(), small);
+        });
+        printf("             %-8s %7.2f GB/s %7.2f GB/s  (%.0f%% of memcpy)\n", k->name,
+               3.0 * big * sizeof(float) / ts / 1e9,
+               3.0 * small * loops * sizeof(float) / tc / 1e9,
+               100.0 * 3.0 * big * sizeof(float) / ts / 1e9 / bw);
+    }
+
+    // Whole transform, counting one read of each input row and one write of
+    // each output row per add.
+    fdmt_plan *plan;
+    int status = fdmt_plan_create(n_f, f_min, f_max, max_dt, &plan);
+    if (status) {
+        fprintf(stderr, "fdmt_plan_create: %s\n", fdmt_strerror(status));
+        return 1;
+    }
+    double bytes = 0;
+    for (int d = 0; d < plan->n_d[0]; d++) bytes += (d ? 3.0 : 2.0) * n_f * n_s * sizeof(float);
+    for (int l = 0; l < plan->n_iter; l++) bytes += 3.0 * plan->merges[l].size() * n_s * sizeof(float);
+
+    std::vector<float> image((size_t)n_f * n_s, 1.0f);
+    std::vector<float> out((size_t)plan->output_rows() * n_s);
+    printf("FDMT %d x %d, maxDT %d, %s, %d threads:\n", n_f, n_s, max_dt, fdmt_simd(),
+           fdmt_get_num_threads());
+    std::vector<int> blocks(1, 0);  // 0: one execute
+    for (int i = 5; i < argc; i++) blocks.push_back(atoi(argv[i]));
+    if (argc <= 5) blocks.insert(blocks.end(), {1024, 4096, 16384});
+    for (int block : blocks) {
+        // The stream is fed the same block over and over: the adds are the
+        // same whatever the samples are.
+        fdmt_stream *stream = NULL;
+        if (block > 0 && fdmt_stream_create(plan, block, FDMT_FLOAT32, &stream) != FDMT_OK) {
+            fprintf(stderr, "fdmt_stream_create: no memory for blocks of %d\n", block);
+            continue;
+        }
+        auto run = [&] {
+            if (!stream) {
+                fdmt_plan_execute(plan, image.data(), n_s, FDMT_FLOAT32, out.data());
+                return;
+            }
+            fdmt_stream_reset(stream);
+            for (int t = 0; t < n_s; t += block)
+                fdmt_stream_push(stream, image.data(), std::min(block, n_s - t), out.data());
+        };
+        run();  // warm the arena
+        t = best_of(reps, run);
+        double miss = cache_miss_rate(run);
+        fdmt_stream_destroy(stream);
+        char name[32], rate[32];
+        snprintf(name, sizeof(name), block ? "block %d" : "execute", block);
+        snprintf(rate, sizeof(rate), miss < 0 ? "n/a" : "%.1f%%", 100 * miss);
+        printf("  %-12s %.3f s, %7.2f GB/s (%3.0f%% of memcpy), LLC miss rate %s\n", name, t,
+               bytes / t / 1e9, 100.0 * bytes / t / 1e9 / bw, rate);
+    }
+    fdmt_plan_destroy(plan);
+    return 0;
+}
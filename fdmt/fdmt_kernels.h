@@ -0,0 +1,66 @@
+/* fdmt_kernels.h
+ * Vector inner loops of the FDMT, picked at run time for the host CPU.
+ *
+ * Every step of the transform comes down to one streaming add of two rows
+ * with an offset between them:
+ *   merge:          out[t] = in[mid][t] + in[rest][t - shift]
+ *   initialization: state[d][t] = state[d-1][t] + image[t - d]
+ * so both call add(o, a, b, n): o[t] = a[t] + b[t] for t in [0, n), with no
+ * alignment assumed. Element-wise IEEE adds are exact, so every variant
+ * gives bit-identical results.
+ *
+ * Half precision is stored as IEEE binary16 and added in float32:
+ * o = half(float(a) + float(b)), rounded to nearest even, which is also what
+ * numpy does for float16 arrays.
+ */
+#ifndef _FDMT_KERNELS_H
+#define _FDMT_KERNELS_H
+
+#include <stdint.h>
+
+// IEEE binary16 storage (numpy float16)
+struct fdmt_half {
+    uint16_t bits;
+};
+
+struct FdmtKernels {
+    const char *name;  // "avx512", "avx2", "sse4.2" or "scalar"
+    void (*add_f32)(float *o, const float *a, const float *b, long n);
+    void (*add_f64)(double *o, const double *a, const double *b, long n);
+    void (*add_i32)(int32_t *o, const int32_t *a, const int32_t *b, long n);
+    void (*add_i64)(int64_t *o, const int64_t *a, const int64_t *b, long n);
+    void (*add_i16)(int16_t *o, const int16_t *a, const int16_t *b, long n);
+    void (*add_f16)(fdmt_half *o, const fdmt_half *a, const fdmt_half *b, long n);
+};
+
+// The kernels in use: the widest the CPU supports, unless the FDMT_SIMD
+// environment variable names a narrower set.
+const FdmtKernels &fdmt_kernels(void);
+
+// The named set, or NULL if it is unknown or this CPU cannot run it.
+const FdmtKernels *fdmt_kernels_named(const char *name);
+
+// All sets, widest first, terminated by a NULL name.
+extern const FdmtKernels fdmt_kernel_sets[];
+
+static inline void fdmt_add(float *o, const float *a, const float *b, long n) {
+    fdmt_kernels().add_f32(o, a, b, n);
+}
+static inline void fdmt_add(double *o, const double *a, const double *b, long n) {
+    fdmt_kernels().add_f64(o, a, b, n);
+}
+static inline void fdmt_add(int32_t *o, const int32_t *a, const int32_t *b, long n) {
+    fdmt_kernels().add_i32(o, a, b, n);
+}
+static inline void fdmt_add(int64_t *o, const int64_t *a, const int64_t *b, long n) {
+    fdmt_kernels().add_i64(o, a, b, n);
+}
+
+static inline void fdmt_add(int16_t *o, const int16_t *a, const int16_t *b, long n) {
+    fdmt_kernels().add_i16(o, a, b, n);
+}
+static inline void fdmt_add(fdmt_half *o, const fdmt_half *a, const fdmt_half *b, long n) {
+    fdmt_kernels().add_f16(o, a, b, n);
+}
+
+#endif
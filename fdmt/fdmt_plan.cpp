@@ -0,0 +1,334 @@
+/* fdmt_plan.cpp
+ * Builds, saves and loads FDMT plans: the per-iteration shift and row
+ * tables, which depend only on (N_f, f_min, f_max, maxDT).
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#include "fdmt_plan.h"
+
+/* ------------------------------------------------------------------------ */
+/* Index arithmetic, mirroring fdmt.py term for term                        */
+/* ------------------------------------------------------------------------ */
+
+// Python evaluates f**2 and f**-2 with libm pow(). Call it the same way (and
+// keep the compiler from folding it into a multiply) so that every ceil()
+// and round() below lands on the same integer as in fdmt.py.
+static double (*volatile const py_pow)(double, double) = pow;
+
+// Python 3 round(): nearest integer, ties to even.
+static inline long py_round(double x) { return (long)nearbyint(x); }
+
+// deltaT of FDMT_initialization
+int fdmt_init_delta_t(int n_f, double f_min, double f_max, int max_dt) {
+    double deltaF = (f_max - f_min) / (double)n_f;
+    return (int)ceil((max_dt - 1) *
+                     (py_pow(f_min, -2) - py_pow(f_min + deltaF, -2)) /
+                     (py_pow(f_min, -2) - py_pow(f_max, -2)));
+}
+
+// deltaT of FDMT_iteration (the largest delay kept after that iteration)
+static int iter_delta_t(int n_f, double f_min, double f_max, int max_dt,
+                        int iteration_num) {
+    double deltaF = (double)(1L << iteration_num) * (f_max - f_min) / (double)n_f;
+    return (int)ceil((max_dt - 1) *
+                     (1. / py_pow(f_min, 2) - 1. / py_pow(f_min + deltaF, 2)) /
+                     (1. / py_pow(f_min, 2) - 1. / py_pow(f_max, 2)));
+}
+
+// Per-output-sub-band constants of one iteration
+struct SubBand {
+    int delta_t_local;  // deltaTLocal: rows 0..delta_t_local are computed
+    double f_start, f_end, f_middle, f_middle_larger;
+};
+
+static SubBand sub_band(int n_f, double f_min, double f_max, int max_dt,
+                        int f_jumps, int i_f) {
+    SubBand sb;
+    double dF = (f_max - f_min) / (double)n_f;
+    double correction = dF / 2.;  // iteration_num is always > 0 here
+    sb.f_start = (f_max - f_min) / (double)f_jumps * i_f + f_min;
+    sb.f_end = (f_max - f_min) / (double)f_jumps * (i_f + 1) + f_min;
+    sb.f_middle = (sb.f_end - sb.f_start) / 2. + sb.f_start - correction;
+    sb.f_middle_larger = (sb.f_end - sb.f_start) / 2 + sb.f_start + correction;
+    sb.delta_t_local = (int)ceil((max_dt - 1) *
+                                 (1. / py_pow(sb.f_start, 2) - 1. / py_pow(sb.f_end, 2)) /
+                                 (1. / py_pow(f_min, 2) - 1. / py_pow(f_max, 2)));
+    return sb;
+}
+
+static long dt_middle(const SubBand &sb, int i_dt) {
+    return py_round(i_dt * (1. / py_pow(sb.f_middle, 2) - 1. / py_pow(sb.f_start, 2)) /
+                    (1. / py_pow(sb.f_end, 2) - 1. / py_pow(sb.f_start, 2)));
+}
+
+static long dt_middle_larger(const SubBand &sb, int i_dt) {
+    return py_round(i_dt * (1. / py_pow(sb.f_middle_larger, 2) - 1. / py_pow(sb.f_start, 2)) /
+                    (1. / py_pow(sb.f_end, 2) - 1. / py_pow(sb.f_start, 2)));
+}
+
+/* ------------------------------------------------------------------------ */
+/* Plan construction                                                        */
+/* ------------------------------------------------------------------------ */
+
+static int build(fdmt_plan *plan) {
+    const int n_f = plan->n_f, max_dt = plan->max_dt;
+    const double f_min = plan->f_min, f_max = plan->f_max;
+
+    plan->n_iter = 0;
+    while ((1 << plan->n_iter) < n_f) plan->n_iter++;
+    plan->n_d.assign(1, fdmt_init_delta_t(n_f, f_min, f_max, max_dt) + 1);
+    plan->merges.clear();
+
+    for (int i_t = 1; i_t <= plan->n_iter; i_t++) {
+        const int in_d = plan->n_d[i_t - 1];
+        const int out_d = iter_delta_t(n_f, f_min, f_max, max_dt, i_t) + 1;
+        const int f_jumps = plan->sub_bands(i_t);
+        plan->n_d.push_back(out_d);
+        plan->merges.push_back(std::vector<FdmtMerge>());
+        std::vector<FdmtMerge> &merges = plan->merges.back();
+        for (int i_f = 0; i_f < f_jumps; i_f++) {
+            SubBand sb = sub_band(n_f, f_min, f_max, max_dt, f_jumps, i_f);
+            if (sb.delta_t_local >= out_d) return FDMT_ERR_INDEX;
+            for (int i_dt = 0; i_dt <= sb.delta_t_local; i_dt++) {
+                long mid = dt_middle(sb, i_dt);
+                long shift = dt_middle_larger(sb, i_dt);
+                long rest = i_dt - shift;
+                if (mid < 0 || mid >= in_d || rest < 0 || rest >= in_d) return FDMT_ERR_INDEX;
+                FdmtMerge m;
+                m.out_row = i_f * out_d + i_dt;
+                m.mid_row = (int32_t)((2 * i_f) * in_d + mid);
+                m.rest_row = (int32_t)((2 * i_f + 1) * in_d + rest);
+                m.shift = (int32_t)shift;
+                merges.push_back(m);
+            }
+        }
+    }
+    return FDMT_OK;
+}
+
+// Drop the output rows below min_dt, then, level by level back towards the
+// initialization, every merge whose result only fed dropped rows. For a
+// DM_min search this removes the low-delay corner of the last few
+// iterations instead of computing it and cropping it off.
+static void prune(fdmt_plan *plan) {
+    if (!plan->min_dt) return;
+    std::vector<FdmtMerge> &last = plan->merges[plan->n_iter - 1];
+    std::vector<FdmtMerge> kept;
+    for (FdmtMerge m : last) {
+        if (m.out_row < plan->min_dt) continue;
+        m.out_row -= plan->min_dt;
+        kept.push_back(m);
+    }
+    last.swap(kept);
+    for (int l = plan->n_iter - 1; l >= 1; l--) {
+        std::vector<char> live(plan->state_rows(l), 0);
+        for (const FdmtMerge &m : plan->merges[l]) live[m.mid_row] = live[m.rest_row] = 1;
+        std::vector<FdmtMerge> &merges = plan->merges[l - 1];
+        kept.clear();
+        for (const FdmtMerge &m : merges)
+            if (live[m.out_row]) kept.push_back(m);
+        merges.swap(kept);
+    }
+}
+
+// Fill in zero_rows from the merge tables.
+static void derive(fdmt_plan *plan) {
+    plan->zero_rows.assign(plan->n_iter + 1, std::vector<int32_t>());
+    for (int l = 1; l <= plan->n_iter; l++) {
+        long rows = l == plan->n_iter ? plan->output_rows() : plan->state_rows(l);
+        std::vector<char> written(rows, 0), read(rows, l == plan->n_iter);
+        for (const FdmtMerge &m : plan->merges[l - 1]) written[m.out_row] = 1;
+        if (l < plan->n_iter) {
+            for (const FdmtMerge &m : plan->merges[l]) {
+                read[m.mid_row] = 1;
+                read[m.rest_row] = 1;
+            }
+        }
+        for (long r = 0; r < rows; r++)
+            if (read[r] && !written[r]) plan->zero_rows[l].push_back((int32_t)r);
+    }
+}
+
+fdmt_plan::~fdmt_plan() {
+    free(arena[0]);
+    free(arena[1]);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Serialization. Native byte order: plans are shared between the cluster   */
+/* nodes, which are all x86-64.                                             */
+/* ------------------------------------------------------------------------ */
+
+// Version 2 added min_dt after max_dt; version 1 files load with min_dt 0.
+static const char plan_magic[8] = {'F', 'D', 'M', 'T', 'P', 'L', 'N', '2'};
+
+static int save(const fdmt_plan *plan, FILE *f) {
+    int ok = fwrite(plan_magic, sizeof(plan_magic), 1, f) == 1;
+    ok = ok && fwrite(&plan->n_f, sizeof(int32_t), 1, f) == 1;
+    ok = ok && fwrite(&plan->max_dt, sizeof(int32_t), 1, f) == 1;
+    ok = ok && fwrite(&plan->min_dt, sizeof(int32_t), 1, f) == 1;
+    ok = ok && fwrite(&plan->n_iter, sizeof(int32_t), 1, f) == 1;
+    ok = ok && fwrite(&plan->f_min, sizeof(double), 1, f) == 1;
+    ok = ok && fwrite(&plan->f_max, sizeof(double), 1, f) == 1;
+    ok = ok && fwrite(plan->n_d.data(), sizeof(int32_t), plan->n_d.size(), f) == plan->n_d.size();
+    for (size_t i = 0; ok && i < plan->merges.size(); i++) {
+        const std::vector<FdmtMerge> &merges = plan->merges[i];
+        int32_t count = (int32_t)merges.size();
+        ok = fwrite(&count, sizeof(int32_t), 1, f) == 1;
+        ok = ok && fwrite(merges.data(), sizeof(FdmtMerge), count, f) == (size_t)count;
+    }
+    return ok ? FDMT_OK : FDMT_ERR_IO;
+}
+
+static int load(fdmt_plan *plan, FILE *f) {
+    char magic[sizeof(plan_magic)];
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, plan_magic, sizeof(magic) - 1))
+        return FDMT_ERR_IO;
+    const char version = magic[sizeof(magic) - 1];
+    if (version != '1' && version != '2') return FDMT_ERR_IO;
+    int ok = fread(&plan->n_f, sizeof(int32_t), 1, f) == 1;
+    ok = ok && fread(&plan->max_dt, sizeof(int32_t), 1, f) == 1;
+    plan->min_dt = 0;
+    if (version >= '2') ok = ok && fread(&plan->min_dt, sizeof(int32_t), 1, f) == 1;
+    ok = ok && fread(&plan->n_iter, sizeof(int32_t), 1, f) == 1;
+    ok = ok && fread(&plan->f_min, sizeof(double), 1, f) == 1;
+    ok = ok && fread(&plan->f_max, sizeof(double), 1, f) == 1;
+    if (!ok || plan->n_iter < 0 || plan->n_iter > 30 || plan->n_f != (1 << plan->n_iter))
+        return FDMT_ERR_IO;
+    plan->n_d.resize(plan->n_iter + 1);
+    ok = fread(plan->n_d.data(), sizeof(int32_t), plan->n_d.size(), f) == plan->n_d.size();
+    for (size_t i = 0; ok && i < plan->n_d.size(); i++) ok = plan->n_d[i] > 0;
+    ok = ok && plan->min_dt >= 0 && plan->min_dt < plan->n_d[plan->n_iter] &&
+         (!plan->min_dt || plan->n_iter > 0);
+    plan->merges.resize(plan->n_iter);
+    for (int i = 0; ok && i < plan->n_iter; i++) {
+        int32_t count;
+        ok = fread(&count, sizeof(int32_t), 1, f) == 1 && count >= 0;
+        if (!ok) break;
+        plan->merges[i].resize(count);
+        ok = fread(plan->merges[i].data(), sizeof(FdmtMerge), count, f) == (size_t)count;
+    }
+    if (!ok) return FDMT_ERR_IO;
+
+    // Refuse tables that would index outside the state cubes.
+    for (int i = 0; i < plan->n_iter; i++) {
+        long in_rows = (long)plan->sub_bands(i) * plan->n_d[i];
+        long out_rows = i + 1 == plan->n_iter ? plan->output_rows() : plan->state_rows(i + 1);
+        for (const FdmtMerge &m : plan->merges[i])
+            if (m.out_row < 0 || m.out_row >= out_rows || m.mid_row < 0 || m.mid_row >= in_rows ||
+                m.rest_row < 0 || m.rest_row >= in_rows || m.shift < 0)
+                return FDMT_ERR_IO;
+    }
+    return FDMT_OK;
+}
+
+/* ------------------------------------------------------------------------ */
+/* C interface                                                              */
+/* ------------------------------------------------------------------------ */
+
+extern "C" {
+
+int fdmt_plan_create(int n_f, double f_min, double f_max, int max_dt, fdmt_plan **plan) {
+    return fdmt_plan_create_range(n_f, f_min, f_max, 0, max_dt, plan);
+}
+
+int fdmt_plan_create_range(int n_f, double f_min, double f_max, int min_dt, int max_dt,
+                           fdmt_plan **plan) {
+    *plan = NULL;
+    if (n_f <= 0 || (n_f & (n_f - 1))) return FDMT_ERR_NF;
+    if (max_dt <= 0 || !(f_min > 0) || !(f_max > f_min)) return FDMT_ERR_ARG;
+    if (min_dt < 0 || (min_dt > 0 && n_f == 1)) return FDMT_ERR_ARG;
+    fdmt_plan *p = new (std::nothrow) fdmt_plan;
+    if (!p) return FDMT_ERR_MEMORY;
+    p->n_f = n_f;
+    p->max_dt = max_dt;
+    p->min_dt = min_dt;
+    p->f_min = f_min;
+    p->f_max = f_max;
+    int status = build(p);
+    if (!status && min_dt >= p->n_d[p->n_iter]) status = FDMT_ERR_ARG;
+    if (status) {
+        delete p;
+        return status;
+    }
+    prune(p);
+    derive(p);
+    *plan = p;
+    return FDMT_OK;
+}
+
+void fdmt_plan_destroy(fdmt_plan *plan) { delete plan; }
+
+void fdmt_plan_params(const fdmt_plan *plan, int *n_f, double *f_min, double *f_max, int *max_dt) {
+    *n_f = plan->n_f;
+    *f_min = plan->f_min;
+    *f_max = plan->f_max;
+    *max_dt = plan->max_dt;
+}
+
+int fdmt_plan_min_dt(const fdmt_plan *plan) { return plan->min_dt; }
+
+long long fdmt_plan_max_terms(const fdmt_plan *plan) {
+    // Row d of the initialization sums d + 1 samples; a merge adds its two
+    // inputs' counts. Unwritten rows hold zeros: no terms.
+    std::vector<long long> terms(plan->state_rows(0));
+    for (long r = 0; r < plan->state_rows(0); r++) terms[r] = r % plan->n_d[0] + 1;
+    long long most = plan->n_d[0];
+    for (int l = 1; l <= plan->n_iter; l++) {
+        long rows = l == plan->n_iter ? plan->output_rows() : plan->state_rows(l);
+        std::vector<long long> next(rows, 0);
+        for (const FdmtMerge &m : plan->merges[l - 1]) {
+            next[m.out_row] = terms[m.mid_row] + terms[m.rest_row];
+            most = std::max(most, next[m.out_row]);
+        }
+        terms.swap(next);
+    }
+    return most;
+}
+
+int fdmt_plan_output_rows(const fdmt_plan *plan) { return plan->output_rows(); }
+
+void fdmt_plan_release(fdmt_plan *plan) {
+    std::lock_guard<std::mutex> lock(plan->arena_mutex);
+    for (int i = 0; i < 2; i++) {
+        free(plan->arena[i]);
+        plan->arena[i] = NULL;
+        plan->arena_bytes[i] = 0;
+    }
+}
+
+int fdmt_plan_save(const fdmt_plan *plan, const char *filename) {
+    FILE *f = fopen(filename, "wb");
+    if (!f) return FDMT_ERR_IO;
+    int status = save(plan, f);
+    if (fclose(f) != 0 && !status) status = FDMT_ERR_IO;
+    return status;
+}
+
+int fdmt_plan_load(const char *filename, fdmt_plan **plan) {
+    *plan = NULL;
+    FILE *f = fopen(filename, "rb");
+    if (!f) return FDMT_ERR_IO;
+    fdmt_plan *p = new (std::nothrow) fdmt_plan;
+    if (!p) {
+        fclose(f);
+        return FDMT_ERR_MEMORY;
+    }
+    int status = load(p, f);
+    fclose(f);
+    if (status) {
+        delete p;
+        return status;
+    }
+    derive(p);
+    *plan = p;
+    return FDMT_OK;
+}
+
+}  // extern "C"
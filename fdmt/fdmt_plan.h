@@ -0,0 +1,60 @@
+/* fdmt_plan.h
+ * Internal layout of an FDMT plan (opaque to C callers, see fdmt.h).
+ */
+#ifndef _FDMT_PLAN_H
+#define _FDMT_PLAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <vector>
+
+#include "fdmt.h"
+
+// One output row of a merge iteration:
+//   out[out_row][t] = in[mid_row][t] + in[rest_row][t - shift]   (t >= shift)
+//   out[out_row][t] = in[mid_row][t]                             (t <  shift)
+// Rows are absolute indices into the [n_f][n_d] rows of a state cube.
+struct FdmtMerge {
+    int32_t out_row;
+    int32_t mid_row;   // sub-band 2*i_F, delay dT_middle
+    int32_t rest_row;  // sub-band 2*i_F+1, delay dT_rest
+    int32_t shift;     // dT_middle_larger
+};
+
+struct fdmt_plan {
+    int32_t n_f;
+    int32_t max_dt;
+    int32_t min_dt;                  // first output row kept, see prune()
+    int32_t n_iter;                  // log2(n_f)
+    double f_min, f_max;
+    std::vector<int32_t> n_d;        // delay rows per sub-band, levels 0..n_iter
+    std::vector<std::vector<FdmtMerge> > merges;  // merges[i] is iteration i+1
+                                     // (output rows numbered from min_dt)
+
+    // Derived from the above (not saved). zero_rows[l] lists the rows of
+    // level l that no merge writes but that the next iteration, or the
+    // output, reads: the only cells that need clearing. zero_rows[0] is
+    // empty since the initialization writes every row.
+    std::vector<std::vector<int32_t> > zero_rows;
+
+    // Scratch for fdmt_plan_execute: level l of the transform lives in
+    // arena[l % 2], so two buffers sized for the largest even and odd
+    // levels serve every iteration. Kept between calls and only grown.
+    std::mutex arena_mutex;
+    void *arena[2];
+    size_t arena_bytes[2];
+
+    fdmt_plan() : min_dt(0), arena(), arena_bytes() {}
+    ~fdmt_plan();
+
+    int sub_bands(int level) const { return n_f >> level; }
+    long state_rows(int level) const { return (long)sub_bands(level) * n_d[level]; }
+    int output_rows() const { return n_d[n_iter] - min_dt; }
+};
+
+// Number of delay rows of the initialization, mirroring fdmt.py.
+int fdmt_init_delta_t(int n_f, double f_min, double f_max, int max_dt);
+
+#endif
@@ -0,0 +1,212 @@
+/* fdmt_stream.cpp
+ * Incremental FDMT over a continuous series, fed one block at a time.
+ *
+ * Every level of the transform keeps, per row, the last few columns the
+ * next level still needs (the largest dT_middle_larger shift of the next
+ * iteration; for the image, the largest initialization delay) followed by
+ * room for new blocks. Pushing a block computes only the block's columns
+ * at every level.
+ * Nothing is recomputed and there are no edge-contaminated columns after
+ * the first block.
+ *
+ * Column t of the series is treated exactly as column t of a one-shot
+ * fdmt_plan_execute over the whole series (including the zeros and missing
+ * shifted terms before each row's delay), so concatenating the blocks'
+ * outputs reproduces it bit for bit.
+ *
+ * Each level holds its kept columns plus room for a block (or for 8x the
+ * kept columns), whatever the length of the series, so this is also the
+ * way to run a transform too long to hold whole.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include "fdmt_kernels.h"
+#include "fdmt_plan.h"
+#include "thread_pool.h"
+
+// The kept columns of one level (or of the image) followed by room for at
+// least one block. Blocks are appended at `cursor`; only when the room runs
+// out are the last `keep` columns moved back to the front, so the copy is
+// paid once every few blocks rather than on every push.
+struct History {
+    void *data;     // [rows][width]
+    long rows;
+    int keep;       // columns the next level reaches back
+    size_t width;
+    size_t cursor;  // column of the next block
+
+    History() : data(NULL), rows(0), keep(0), width(0), cursor(0) {}
+};
+
+struct fdmt_stream {
+    const fdmt_plan *plan;
+    int dtype;
+    size_t elem;              // bytes per element
+    int max_block;
+    long long position;       // samples pushed so far
+    std::vector<History> hist;  // the image, then levels 0..n_iter-1
+
+    ~fdmt_stream() {
+        for (History &h : hist) free(h.data);
+    }
+};
+
+template <typename T>
+static void push(fdmt_stream *s, const T *image, int n, T *out) {
+    const fdmt_plan *plan = s->plan;
+    const long long pos = s->position;
+    std::shared_ptr<ThreadPool> pool_ref = fdmt_pool();  // held for the whole push
+    ThreadPool &tp = *pool_ref;
+
+    // Number of leading block columns whose series time is below `delay`
+    auto before = [&](long delay) { return (int)std::max(0LL, std::min<long long>(delay - pos, n)); };
+
+    for (History &h : s->hist) {
+        if (h.cursor + n <= h.width) continue;
+        const size_t from = h.cursor - h.keep;
+        if (h.keep > 0)
+            tp.parallel_for(h.rows, [&](long r) {
+                T *row = (T *)h.data + r * h.width;
+                memmove(row, row + from, sizeof(T) * h.keep);
+            });
+        h.cursor = h.keep;
+    }
+    // Pointer to block column 0 of row r of level l (-1: the image); the
+    // last level is the caller's output.
+    auto row = [&](int l, long r) {
+        if (l == plan->n_iter) return out + r * n;
+        const History &h = s->hist[l + 1];
+        return (T *)h.data + r * h.width + h.cursor;
+    };
+
+    const int n_d0 = plan->n_d[0];
+    tp.parallel_for(plan->n_f, [&](long i_f) {
+        T *in = row(-1, i_f);
+        memcpy(in, image + i_f * n, sizeof(T) * n);
+        T *prev = row(0, i_f * n_d0);
+        memcpy(prev, in, sizeof(T) * n);
+        for (int i_dt = 1; i_dt < n_d0; i_dt++) {
+            T *cur = row(0, i_f * n_d0 + i_dt);
+            int z = before(i_dt);
+            memset(cur, 0, sizeof(T) * z);
+            fdmt_add(cur + z, prev + z, in + z - i_dt, n - z);
+            prev = cur;
+        }
+    });
+
+    for (int l = 1; l <= plan->n_iter; l++) {
+        if (l == plan->n_iter)
+            for (int32_t r : plan->zero_rows[l]) memset(row(l, r), 0, sizeof(T) * n);
+        const std::vector<FdmtMerge> &merges = plan->merges[l - 1];
+        tp.parallel_for((long)merges.size(), [&](long k) {
+            const FdmtMerge &m = merges[k];
+            const T *a = row(l - 1, m.mid_row);
+            const T *b = row(l - 1, m.rest_row) - m.shift;
+            T *dst = row(l, m.out_row);
+            int split = before(m.shift);
+            memcpy(dst, a, sizeof(T) * split);
+            fdmt_add(dst + split, a + split, b + split, n - split);
+        });
+    }
+
+    for (History &h : s->hist) h.cursor += n;
+    s->position += n;
+}
+
+static size_t elem_size(int dtype) {
+    switch (dtype) {
+    case FDMT_FLOAT32: return sizeof(float);
+    case FDMT_FLOAT64: return sizeof(double);
+    case FDMT_INT32: return sizeof(int32_t);
+    case FDMT_INT64: return sizeof(int64_t);
+    case FDMT_INT16: return sizeof(int16_t);
+    case FDMT_FLOAT16: return sizeof(fdmt_half);
+    }
+    return 0;
+}
+
+static void push_any(fdmt_stream *s, const void *image, int n, void *out) {
+    switch (s->dtype) {
+    case FDMT_FLOAT32:
+        push(s, (const float *)image, n, (float *)out);
+        break;
+    case FDMT_FLOAT64:
+        push(s, (const double *)image, n, (double *)out);
+        break;
+    case FDMT_INT32:
+        push(s, (const int32_t *)image, n, (int32_t *)out);
+        break;
+    case FDMT_INT64:
+        push(s, (const int64_t *)image, n, (int64_t *)out);
+        break;
+    case FDMT_INT16:
+        push(s, (const int16_t *)image, n, (int16_t *)out);
+        break;
+    case FDMT_FLOAT16:
+        push(s, (const fdmt_half *)image, n, (fdmt_half *)out);
+        break;
+    }
+}
+
+extern "C" {
+
+int fdmt_stream_create(const fdmt_plan *plan, int max_block, int dtype, fdmt_stream **stream) {
+    *stream = NULL;
+    if (max_block <= 0) return FDMT_ERR_ARG;
+    if (!elem_size(dtype)) return FDMT_ERR_DTYPE;
+    fdmt_stream *s = new (std::nothrow) fdmt_stream;
+    if (!s) return FDMT_ERR_MEMORY;
+    s->plan = plan;
+    s->dtype = dtype;
+    s->elem = elem_size(dtype);
+    s->max_block = max_block;
+    s->position = 0;
+    s->hist.resize(plan->n_iter + 1);
+    s->hist[0].rows = plan->n_f;
+    s->hist[0].keep = plan->n_d[0] - 1;
+    for (int l = 0; l < plan->n_iter; l++) {
+        History &h = s->hist[l + 1];
+        h.rows = plan->state_rows(l);
+        for (const FdmtMerge &m : plan->merges[l]) h.keep = std::max(h.keep, (int)m.shift);
+    }
+    // calloc: rows no merge writes must read as zeros for good. Room for 8x the kept columns keeps the moves
+    // under ~1/8 of the traffic when blocks are short.
+    bool ok = true;
+    for (History &h : s->hist) {
+        h.width = h.keep + std::max((size_t)max_block, 8 * (size_t)h.keep);
+        h.cursor = h.keep;
+        h.data = calloc(h.rows * h.width, s->elem);
+        ok = ok && h.data;
+    }
+    if (!ok) {
+        delete s;
+        return FDMT_ERR_MEMORY;
+    }
+    *stream = s;
+    return FDMT_OK;
+}
+
+void fdmt_stream_destroy(fdmt_stream *stream) { delete stream; }  // NULL is fine
+
+long long fdmt_stream_position(const fdmt_stream *stream) { return stream->position; }
+
+void fdmt_stream_reset(fdmt_stream *stream) {
+    // Nothing before position 0 is ever read (see before() in push), so the
+    // old history can stay.
+    for (History &h : stream->hist) h.cursor = h.keep;
+    stream->position = 0;
+}
+
+int fdmt_stream_push(fdmt_stream *stream, const void *image, int n, void *out) {
+    if (n <= 0 || n > stream->max_block) return FDMT_ERR_ARG;
+    push_any(stream, image, n, out);
+    return FDMT_OK;
+}
+
+}  // extern "C"
@@ -0,0 +1,97 @@
+/* thread_pool.h
+ * Minimal persistent worker pool used by the FDMT engine.
+ */
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+  public:
+    explicit ThreadPool(int nthreads)
+        : fn_(nullptr), n_(0), next_(0), active_(0), generation_(0), stop_(false) {
+        // The calling thread always takes part, so start one fewer worker.
+        for (int i = 1; i < nthreads; i++)
+            workers_.emplace_back([this] { worker(); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &w : workers_) w.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int size() const { return (int)workers_.size() + 1; }
+
+    // Run fn(i) for every i in [0, n), handing out indices to whichever
+    // thread is free next. Blocks until all n calls have returned.
+    void parallel_for(long n, const std::function<void(long)> &fn) {
+        if (n <= 0) return;
+        std::lock_guard<std::mutex> call(call_mutex_);  // one job at a time
+        if (workers_.empty() || n == 1) {
+            for (long i = 0; i < n; i++) fn(i);
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        fn_ = &fn;
+        n_ = n;
+        next_.store(0);
+        active_ = (int)workers_.size();
+        generation_++;
+        lock.unlock();
+        wake_.notify_all();
+        run();
+        lock.lock();
+        done_.wait(lock, [this] { return active_ == 0; });
+        fn_ = nullptr;
+    }
+
+  private:
+    void run() {
+        long i;
+        while ((i = next_.fetch_add(1)) < n_) (*fn_)(i);
+    }
+
+    void worker() {
+        unsigned long seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_) return;
+            seen = generation_;
+            lock.unlock();
+            run();
+            lock.lock();
+            if (--active_ == 0) done_.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex call_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_, done_;
+    const std::function<void(long)> *fn_;
+    long n_;
+    std::atomic<long> next_;
+    int active_;
+    unsigned long generation_;
+    bool stop_;
+};
+
+// The pool shared by all FDMT transforms (fdmt.cpp), sized by
+// fdmt_set_num_threads. Hold the returned pointer for the whole job.
+std::shared_ptr<ThreadPool> fdmt_pool(void);
+
+#endif